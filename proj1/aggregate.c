@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "aggregate.h"
+#include "analyze.h"
+#include "pool.h"
+#include "stamp.h"
+#include "table.h"
+
+// A key to group by, optionally cut to the first 'width' characters of the
+// value so that e.g. "DateTimeOriginal:7" groups by month.
+struct group_key {
+	char *name;
+	int width;
+};
+
+// Totals for one group.
+struct group {
+	long files;
+	char earliest[STAMP_LEN];
+	char latest[STAMP_LEN];
+};
+
+// A field buffered until the file is known to be readable.
+struct field {
+	char *kv;
+	int keylen;
+	int length;
+};
+
+struct aggregate {
+	struct group_key *keys;
+	int nkeys;
+	// The keys to list the most common values of, and how many.
+	struct group_key *top_keys;
+	int ntop_keys;
+	int top;
+	// Totals over every readable file.
+	struct group all;
+	long errors;
+	// I/O totals when files are read with pread planning.
+	struct io_stats io;
+	long over_budget;
+	// Group tuple (values joined by NULs) -> struct group*.
+	struct table *groups;
+	// "key\0value" -> occurrence count, stored in the pointer itself, for the
+	// top keys only, so it grows with how many distinct values those have
+	// rather than with the corpus.
+	struct table *values;
+	// The fields of the file being analyzed.
+	struct field *fields;
+	int nfields;
+	int size;
+};
+
+/*
+ * Widens the time range of 'g' to include 'stamp'.
+ */
+static void group_add_stamp(struct group *g, const char *stamp) {
+	if(g->earliest[0] == 0 || strcmp(stamp, g->earliest) < 0) { strcpy(g->earliest, stamp); }
+	if(g->latest[0] == 0 || strcmp(stamp, g->latest) > 0) { strcpy(g->latest, stamp); }
+}
+
+/*
+ * Adds the totals of 'from' into 'into'.
+ */
+static void group_merge(struct group *into, struct group *from) {
+	into->files += from->files;
+	if(from->earliest[0] != 0) { group_add_stamp(into, from->earliest); }
+	if(from->latest[0] != 0) { group_add_stamp(into, from->latest); }
+}
+
+/*
+ * Parses a comma separated list of "Key" or "Key:width" into 'keys' and
+ * 'nkeys'. Returns 0 on success, -1 otherwise.
+ */
+static int parse_group_keys(struct group_key **keys, int *nkeys, const char *spec) {
+	char *list = strdup(spec), *save = NULL, *tok;
+	if(list == NULL) { return -1; }
+	for(tok = strtok_r(list, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		struct group_key *bigger = realloc(*keys, (*nkeys + 1) * sizeof(struct group_key));
+		if(bigger == NULL) { break; }
+		*keys = bigger;
+		char *colon = strchr(tok, ':');
+		bigger[*nkeys].width = 0;
+		if(colon != NULL) {
+			*colon = 0;
+			bigger[*nkeys].width = atoi(colon + 1);
+		}
+		if((bigger[*nkeys].name = strdup(tok)) == NULL) { break; }
+		(*nkeys)++;
+	}
+	free(list);
+	return tok == NULL ? 0 : -1;
+}
+
+/*
+ * Returns how much of the value of 'f' counts for 'key'.
+ */
+static int key_width(struct group_key *key, struct field *f) {
+	return (key->width > 0 && key->width < f->length) ? key->width : f->length;
+}
+
+static void free_aggregate(struct aggregate *a) {
+	int i;
+	for(i = 0; i < a->nkeys; i++) { free(a->keys[i].name); }
+	for(i = 0; i < a->ntop_keys; i++) { free(a->top_keys[i].name); }
+	for(i = 0; i < a->nfields; i++) { free(a->fields[i].kv); }
+	free(a->keys);
+	free(a->top_keys);
+	free(a->fields);
+	if(a->groups != NULL) { table_free(a->groups, free); }
+	if(a->values != NULL) { table_free(a->values, NULL); }
+	free(a);
+}
+
+static struct aggregate* create_aggregate(const char *group_by, const char *top_keys, int top) {
+	struct aggregate *a = calloc(1, sizeof(struct aggregate));
+	if(a == NULL) { return NULL; }
+	a->top = top;
+	a->groups = table_create();
+	a->values = table_create();
+	if(a->groups == NULL || a->values == NULL ||
+		parse_group_keys(&a->keys, &a->nkeys, group_by) == -1 ||
+		parse_group_keys(&a->top_keys, &a->ntop_keys, top_keys) == -1) {
+		free_aggregate(a);
+		return NULL;
+	}
+	return a;
+}
+
+static void on_begin(struct report *r, const char *filename) {
+	struct aggregate *a = r->ctx;
+	int i;
+	for(i = 0; i < a->nfields; i++) { free(a->fields[i].kv); }
+	a->nfields = 0;
+}
+
+static void on_field(struct report *r, const char *key, const char *value, int length) {
+	struct aggregate *a = r->ctx;
+	if(a->nfields == a->size) {
+		int size = a->size ? a->size * 2 : 16;
+		struct field *fields = realloc(a->fields, size * sizeof(struct field));
+		if(fields == NULL) { return; }
+		a->fields = fields;
+		a->size = size;
+	}
+	int keylen = strlen(key);
+	char *kv = malloc(keylen + 1 + length + 1);
+	if(kv == NULL) { return; }
+	memcpy(kv, key, keylen + 1);
+	memcpy(kv + keylen + 1, value, length);
+	kv[keylen + 1 + length] = 0;
+	a->fields[a->nfields].kv = kv;
+	a->fields[a->nfields].keylen = keylen;
+	a->fields[a->nfields].length = length;
+	a->nfields++;
+}
+
+/*
+ * Returns the buffered field named 'key', or NULL if the file had none.
+ */
+static struct field* find_field(struct aggregate *a, const char *key) {
+	int i;
+	for(i = 0; i < a->nfields; i++) {
+		if(strcmp(a->fields[i].kv, key) == 0) { return &a->fields[i]; }
+	}
+	return NULL;
+}
+
+/*
+ * Folds the buffered fields of a readable file into the totals. Unreadable
+ * files are only counted, since their fields may be partial.
+ */
+static void on_end(struct report *r, const char *filename, int rv) {
+	struct aggregate *a = r->ctx;
+	int i;
+	if(rv < 0) {
+		a->errors++;
+		return;
+	}
+	// Date the file by the most preferred timestamp it has.
+	char stamp[STAMP_LEN] = "";
+	for(i = 0; i < NSTAMP_KEYS && stamp[0] == 0; i++) {
+		struct field *f = find_field(a, STAMP_KEYS[i]);
+		if(f != NULL && stamp_normalize(f->kv + f->keylen + 1, stamp) == -1) { stamp[0] = 0; }
+	}
+	a->all.files++;
+	if(stamp[0] != 0) { group_add_stamp(&a->all, stamp); }
+	// Build the group tuple. The values are joined with NULs, which no value
+	// holds, so no two tuples of values run together the same way.
+	char *tuple = NULL;
+	size_t tuple_len = 0;
+	FILE *t = open_memstream(&tuple, &tuple_len);
+	if(t == NULL) { return; }
+	for(i = 0; i < a->nkeys; i++) {
+		struct field *f = find_field(a, a->keys[i].name);
+		if(i > 0) { fputc('\0', t); }
+		if(f == NULL) {
+			fputs("(none)", t);
+		} else {
+			fwrite(f->kv + f->keylen + 1, 1, key_width(&a->keys[i], f), t);
+		}
+	}
+	fclose(t);
+	struct group **g = (struct group**) table_slot(a->groups, tuple, tuple_len);
+	if(g != NULL && (*g != NULL || (*g = calloc(1, sizeof(struct group))) != NULL)) {
+		(*g)->files++;
+		if(stamp[0] != 0) { group_add_stamp(*g, stamp); }
+	}
+	free(tuple);
+	// Count the values of the top keys for the top-K lists.
+	if(a->top > 0) {
+		for(i = 0; i < a->ntop_keys; i++) {
+			struct field *f = find_field(a, a->top_keys[i].name);
+			if(f == NULL) { continue; }
+			void **count = table_slot(a->values, f->kv, f->keylen + 1 + key_width(&a->top_keys[i], f));
+			if(count != NULL) { *count = (void*) ((uintptr_t) *count + 1); }
+		}
+	}
+}
+
+static void on_io(struct report *r, const char *filename, struct io_stats *io) {
+	struct aggregate *a = r->ctx;
+	a->io.bytes_read += io->bytes_read;
+	a->io.file_size += io->file_size;
+	a->io.reads += io->reads;
+	if(io->over_budget) { a->over_budget++; }
+}
+
+static void merge_group(const char *key, int length, void *value, void *ctx) {
+	struct group **g = (struct group**) table_slot(ctx, key, length);
+	if(g == NULL) { return; }
+	if(*g == NULL && (*g = calloc(1, sizeof(struct group))) == NULL) { return; }
+	group_merge(*g, value);
+}
+
+static void merge_value(const char *key, int length, void *value, void *ctx) {
+	void **count = table_slot(ctx, key, length);
+	if(count != NULL) { *count = (void*) ((uintptr_t) *count + (uintptr_t) value); }
+}
+
+/*
+ * Adds every total in 'from' into 'into'.
+ */
+static void merge_aggregate(struct aggregate *into, struct aggregate *from) {
+	group_merge(&into->all, &from->all);
+	into->errors += from->errors;
+	into->io.bytes_read += from->io.bytes_read;
+	into->io.file_size += from->io.file_size;
+	into->io.reads += from->io.reads;
+	into->over_budget += from->over_budget;
+	table_each(from->groups, merge_group, into->groups);
+	table_each(from->values, merge_value, into->values);
+}
+
+// A table entry copied out for sorting.
+struct row {
+	const char *key;
+	int length;
+	void *value;
+};
+
+// Collects table entries into an array of rows.
+struct rows {
+	struct row *rows;
+	int n;
+};
+
+static void collect_row(const char *key, int length, void *value, void *ctx) {
+	struct rows *rows = ctx;
+	rows->rows[rows->n].key = key;
+	rows->rows[rows->n].length = length;
+	rows->rows[rows->n].value = value;
+	rows->n++;
+}
+
+/*
+ * Returns the rows of 't', or NULL if out of memory.
+ */
+static struct row* table_rows(struct table *t) {
+	struct rows rows = { malloc((table_count(t) + 1) * sizeof(struct row)), 0 };
+	if(rows.rows != NULL) { table_each(t, collect_row, &rows); }
+	return rows.rows;
+}
+
+// Largest groups first, ties broken by the tuple.
+static int compare_groups(const void *x, const void *y) {
+	const struct row *a = x, *b = y;
+	long fa = ((struct group*) a->value)->files, fb = ((struct group*) b->value)->files;
+	if(fa != fb) { return fa > fb ? -1 : 1; }
+	// Tuples hold NULs, so compare their whole length.
+	int c = memcmp(a->key, b->key, a->length < b->length ? a->length : b->length);
+	if(c != 0) { return c; }
+	return a->length - b->length;
+}
+
+// Grouped by key, then most common values first, ties broken by the value.
+static int compare_values(const void *x, const void *y) {
+	const struct row *a = x, *b = y;
+	int c = strcmp(a->key, b->key);
+	if(c != 0) { return c; }
+	if(a->value != b->value) { return (uintptr_t) a->value > (uintptr_t) b->value ? -1 : 1; }
+	return strcmp(a->key + strlen(a->key) + 1, b->key + strlen(b->key) + 1);
+}
+
+/*
+ * Prints 'length' bytes of 's', escaping tabs, newlines and backslashes so
+ * that every row stays on one line.
+ */
+static void print_escaped(FILE *out, const char *s, int length) {
+	while(length--) {
+		char c = *s++;
+		switch(c) {
+			case '\t': fputs("\\t", out); break;
+			case '\n': fputs("\\n", out); break;
+			case '\r': fputs("\\r", out); break;
+			case '\\': fputs("\\\\", out); break;
+			default: fputc(c, out);
+		}
+	}
+}
+
+static void print_aggregate(struct aggregate *a, FILE *out) {
+	int i;
+	fprintf(out, "Files: %ld\n", a->all.files);
+	fprintf(out, "Errors: %ld\n", a->errors);
+	fprintf(out, "Earliest: %s\n", a->all.earliest[0] ? a->all.earliest : "(none)");
+	fprintf(out, "Latest: %s\n", a->all.latest[0] ? a->all.latest : "(none)");
+	if(a->io.reads > 0) {
+		fprintf(out, "Read: %lld of %lld bytes in %d reads\n",
+			a->io.bytes_read, a->io.file_size, a->io.reads);
+		fprintf(out, "Over I/O budget: %ld\n", a->over_budget);
+	}
+
+	// One tab separated row per group.
+	struct row *rows = table_rows(a->groups);
+	if(rows == NULL) { return; }
+	int n = table_count(a->groups);
+	qsort(rows, n, sizeof(struct row), compare_groups);
+	fputc('\n', out);
+	for(i = 0; i < a->nkeys; i++) { fprintf(out, "%s\t", a->keys[i].name); }
+	fprintf(out, "Files\tEarliest\tLatest\n");
+	for(i = 0; i < n; i++) {
+		struct group *g = rows[i].value;
+		// Each value of the tuple is a column, with its own tabs escaped.
+		const char *p = rows[i].key, *end = p + rows[i].length;
+		while(p <= end) {
+			const char *nul = memchr(p, 0, end - p);
+			if(nul == NULL) { nul = end; }
+			print_escaped(out, p, nul - p);
+			fputc('\t', out);
+			p = nul + 1;
+		}
+		fprintf(out, "%ld\t%s\t%s\n", g->files,
+			g->earliest[0] ? g->earliest : "-", g->latest[0] ? g->latest : "-");
+	}
+	free(rows);
+
+	if(a->top <= 0) { return; }
+	rows = table_rows(a->values);
+	if(rows == NULL) { return; }
+	n = table_count(a->values);
+	qsort(rows, n, sizeof(struct row), compare_values);
+	fprintf(out, "\nKey\tValue\tFiles\n");
+	int rank = 0;
+	for(i = 0; i < n; i++) {
+		rank = (i > 0 && strcmp(rows[i].key, rows[i - 1].key) == 0) ? rank + 1 : 0;
+		if(rank >= a->top) { continue; }
+		int keylen = strlen(rows[i].key);
+		print_escaped(out, rows[i].key, keylen);
+		fputc('\t', out);
+		print_escaped(out, rows[i].key + keylen + 1, rows[i].length - keylen - 1);
+		fprintf(out, "\t%lu\n", (unsigned long) (uintptr_t) rows[i].value);
+	}
+	free(rows);
+}
+
+static void aggregate_worker(int worker, void *item, void *ctx) {
+	struct aggregate *a = ((struct aggregate**) ctx)[worker];
+	struct report r = { .begin = on_begin, .field = on_field, .end = on_end, .io = on_io, .ctx = a };
+	analyze(item, &r);
+}
+
+/*
+ * Analyzes 'files' on 'threads' workers without printing anything per file,
+ * then prints a summary: totals and time range, one row per distinct tuple of
+ * 'group_by' values, and the 'top' most common values of each of 'top_keys',
+ * which default to the 'group_by' keys. Each worker keeps its own totals,
+ * which are merged once all files are done. Returns 0 on success, -1
+ * otherwise.
+ */
+int aggregate_files(char **files, int nfiles, const char *group_by, const char *top_keys, int top, int threads) {
+	int i, rv = -1;
+	struct aggregate **aggs = calloc(threads, sizeof(struct aggregate*));
+	if(aggs == NULL) { return -1; }
+	for(i = 0; i < threads; i++) {
+		if((aggs[i] = create_aggregate(group_by, top_keys ? top_keys : group_by, top)) == NULL) { goto done; }
+	}
+	struct pool *p = pool_create(threads, aggregate_worker, aggs);
+	if(p == NULL) { goto done; }
+	for(i = 0; i < nfiles; i++) {
+		if(pool_submit(p, files[i]) == -1) { break; }
+	}
+	pool_finish(p);
+	if(i < nfiles) { goto done; }
+	for(i = 1; i < threads; i++) { merge_aggregate(aggs[0], aggs[i]); }
+	print_aggregate(aggs[0], stdout);
+	rv = 0;
+done:
+	for(i = 0; i < threads; i++) {
+		if(aggs[i] != NULL) { free_aggregate(aggs[i]); }
+	}
+	free(aggs);
+	return rv;
+}
@@ -0,0 +1,6 @@
+#ifndef AGGREGATE_H_GUARD
+#define AGGREGATE_H_GUARD
+
+int aggregate_files(char **files, int nfiles, const char *group_by, const char *top_keys, int top, int threads);
+
+#endif
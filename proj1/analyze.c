@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "analyze.h"
+#include "png.h"
+#include "jpg.h"
+#include "planio.h"
+#include "stream.h"
+
+// Set by analyze_use_pread() before any file is analyzed.
+static int use_pread = 0;
+static long long io_budget = -1;
+
+/*
+ * Makes analyze() read files with pread planning, giving up on a file once
+ * 'budget' bytes of it have been read, unless 'budget' is negative.
+ */
+void analyze_use_pread(long long budget) {
+    use_pread = 1;
+    io_budget = budget;
+}
+
+int try_analyze_png_file(char *filename, struct report *r) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+        return -1;
+    int rv = analyze_png(f, r);
+    fclose(f);
+    return rv;
+}
+
+int try_analyze_jpg_file(char *filename, struct report *r) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+        return -1;
+    int rv = analyze_jpg(f, r);
+    fclose(f);
+    return rv;
+}
+
+int try_analyze_planned(struct planned_file *pf, int (*analyze_fn)(FILE *f, struct report *r), struct report *r) {
+    FILE *f = planio_stream(pf);
+    if (f == NULL)
+        return -1;
+    int rv = analyze_fn(f, r);
+    fclose(f);
+    return rv;
+}
+
+/*
+ * Like analyze(), but reads the file with pread planning and reports how much
+ * of it was read.
+ */
+int analyze_planned(char *filename, struct report *r) {
+    int rv = -1;
+    report_begin(r, filename);
+    struct planned_file *pf = planio_open(filename, io_budget);
+    if (pf != NULL) {
+        rv = try_analyze_planned(pf, analyze_png, r);
+        if (rv < 0 && !planio_stats(pf)->over_budget) {
+            rv = try_analyze_planned(pf, analyze_jpg, r);
+        }
+        // A read the budget refused can look like the end of the file to a
+        // parser, so the file was not fully read even if it says otherwise.
+        if (planio_stats(pf)->over_budget)
+            rv = -1;
+        report_io(r, filename, planio_stats(pf));
+        planio_close(pf);
+    }
+    report_end(r, filename, rv);
+    return rv;
+}
+
+/*
+ * Returns whether 'filename' is "-", for standard input, or something else
+ * that can only be read front to back, like a pipe or a socket.
+ */
+int is_stream(char *filename) {
+    struct stat st;
+    if (strcmp(filename, "-") == 0)
+        return 1;
+    if (stat(filename, &st) != 0)
+        return 0;
+    return S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || S_ISCHR(st.st_mode);
+}
+
+/*
+ * Like analyze(), but reads the file in one forward pass, so it works on
+ * standard input and pipes.
+ */
+int analyze_streamed(char *filename, struct report *r) {
+    int rv = -1;
+    report_begin(r, filename);
+    int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd >= 0) {
+        rv = analyze_stream(fd, r);
+        if (fd != STDIN_FILENO)
+            close(fd);
+    }
+    report_end(r, filename, rv);
+    return rv;
+}
+
+/*
+ * Analyzes 'filename' as a PNG, then as a JPG, reporting its metadata to 'r'.
+ * Returns 0 if either succeeded, -1 otherwise.
+ */
+int analyze(char *filename, struct report *r) {
+    int rv;
+    if (is_stream(filename))
+        return analyze_streamed(filename, r);
+    if (use_pread)
+        return analyze_planned(filename, r);
+    report_begin(r, filename);
+    rv = try_analyze_png_file(filename, r);
+    if (rv < 0) {
+        rv = try_analyze_jpg_file(filename, r);
+    }
+    report_end(r, filename, rv);
+    return rv;
+}
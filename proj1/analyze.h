@@ -0,0 +1,10 @@
+#ifndef ANALYZE_H_GUARD
+#define ANALYZE_H_GUARD
+
+#include "report.h"
+
+void analyze_use_pread(long long budget);
+int is_stream(char *filename);
+int analyze(char *filename, struct report *r);
+
+#endif
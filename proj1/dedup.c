@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dedup.h"
+#include "analyze.h"
+#include "pool.h"
+#include "table.h"
+
+// How much of each end of a file goes into its quick hash.
+#define BLOCK 4096
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+/*
+ * The parsed result of one distinct file content, kept for the files found to
+ * have the same bytes.
+ */
+struct original {
+	// The file that was parsed, and the index of that file.
+	char *path;
+	int owner;
+	// The hash of the whole file, if 'hashed', worked out at most once
+	// under 'hash_lock'. Originals added to a list that was not empty are
+	// hashed before anyone else can see them.
+	pthread_mutex_t hash_lock;
+	unsigned long long full;
+	int hashed;
+	// The printed fields and what analyze() returned, once 'parsed'.
+	char *body;
+	size_t length;
+	int rv;
+	int parsed;
+	// The index of the first file printed with this content, or -1.
+	int first;
+	// The next original with the same quick hash. Lists only grow at the
+	// front, so they can be walked without 'map_lock' from a head read under
+	// it.
+	struct original *next;
+};
+
+// What a file turned out to be; 'original' is NULL if it could not be analyzed.
+struct result {
+	struct original *original;
+	int ready;
+};
+
+struct dedup {
+	char **files;
+	int nfiles;
+	// Quick hash keys to lists of originals, guarded by 'map_lock'.
+	struct table *map;
+	pthread_mutex_t map_lock;
+	// Guards the results and everything printed.
+	pthread_mutex_t out_lock;
+	struct result *results;
+	int next;
+	int duplicates;
+};
+
+static unsigned long long rotl(unsigned long long x, int n) {
+	return (x << n) | (x >> (64 - n));
+}
+
+static unsigned long long read64(const unsigned char *p) {
+	unsigned long long v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned long long round64(unsigned long long acc, unsigned long long input) {
+	acc += input * PRIME2;
+	return rotl(acc, 31) * PRIME1;
+}
+
+static unsigned long long merge64(unsigned long long acc, unsigned long long v) {
+	acc ^= round64(0, v);
+	return acc * PRIME1 + PRIME4;
+}
+
+/*
+ * Returns the XXH64 hash of the first 'length' bytes of 'data'. The four
+ * independent lanes keep the main loop free of dependencies between
+ * iterations, so it runs at memory speed.
+ */
+static unsigned long long xxh64(const unsigned char *data, size_t length, unsigned long long seed) {
+	const unsigned char *p = data, *end = data + length;
+	unsigned long long h;
+	if(length >= 32) {
+		unsigned long long v1 = seed + PRIME1 + PRIME2, v2 = seed + PRIME2;
+		unsigned long long v3 = seed, v4 = seed - PRIME1;
+		for(; p + 32 <= end; p += 32) {
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+		}
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	} else {
+		h = seed + PRIME5;
+	}
+	h += length;
+	for(; p + 8 <= end; p += 8) {
+		h ^= round64(0, read64(p));
+		h = rotl(h, 27) * PRIME1 + PRIME4;
+	}
+	if(p + 4 <= end) {
+		unsigned int k;
+		memcpy(&k, p, sizeof(k));
+		h ^= k * PRIME1;
+		h = rotl(h, 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	for(; p < end; p++) {
+		h ^= *p * PRIME5;
+		h = rotl(h, 11) * PRIME1;
+	}
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * Fills 'key' with the size of 'path' and a hash of its first and last
+ * BLOCK bytes, which tells most different files apart without reading them.
+ * Returns 0 on success, -1 otherwise.
+ */
+static int quick_key(const char *path, unsigned long long key[2]) {
+	unsigned char head[BLOCK], tail[BLOCK];
+	struct stat st;
+	int rv = -1;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) { return -1; }
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		size_t n = st.st_size < BLOCK ? st.st_size : BLOCK;
+		if(pread(fd, head, n, 0) == n && pread(fd, tail, n, st.st_size - n) == n) {
+			key[0] = st.st_size;
+			key[1] = xxh64(tail, n, xxh64(head, n, st.st_size));
+			rv = 0;
+		}
+	}
+	close(fd);
+	return rv;
+}
+
+/*
+ * Maps all of 'path' into memory and sets 'size'. Returns the mapping, or
+ * NULL on failure or if the file is empty.
+ */
+static unsigned char* map_file(const char *path, size_t *size) {
+	struct stat st;
+	unsigned char *data = NULL;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) { return NULL; }
+	if(fstat(fd, &st) == 0 && st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data == MAP_FAILED) {
+			data = NULL;
+		} else {
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			*size = st.st_size;
+		}
+	}
+	close(fd);
+	return data;
+}
+
+/*
+ * Sets 'hash' to the hash of the whole of 'path'. Returns 0 on success, -1
+ * otherwise.
+ */
+static int full_hash(const char *path, unsigned long long *hash) {
+	size_t size;
+	unsigned char *data = map_file(path, &size);
+	if(data == NULL) { return -1; }
+	*hash = xxh64(data, size, 0);
+	munmap(data, size);
+	return 0;
+}
+
+/*
+ * Returns whether 'a' and 'b' have the same bytes. A matching hash is not
+ * taken on trust, since files built to collide are easy to make.
+ */
+static int same_content(const char *a, const char *b) {
+	size_t a_size, b_size;
+	int same = 0;
+	unsigned char *a_data = map_file(a, &a_size);
+	unsigned char *b_data = map_file(b, &b_size);
+	if(a_data != NULL && b_data != NULL) {
+		same = a_size == b_size && memcmp(a_data, b_data, a_size) == 0;
+	}
+	if(a_data != NULL) { munmap(a_data, a_size); }
+	if(b_data != NULL) { munmap(b_data, b_size); }
+	return same;
+}
+
+static struct original* new_original(char *path, int owner) {
+	struct original *o = calloc(1, sizeof(struct original));
+	if(o == NULL) { return NULL; }
+	o->path = path;
+	o->owner = owner;
+	o->first = -1;
+	pthread_mutex_init(&o->hash_lock, NULL);
+	return o;
+}
+
+static void free_original(struct original *o) {
+	pthread_mutex_destroy(&o->hash_lock);
+	free(o->body);
+	free(o);
+}
+
+/*
+ * Sets 'full' to the hash of the whole of 'o', hashing it if no one has yet.
+ * Only callers wanting the same original wait for each other. Returns 0 on
+ * success, -1 if the file cannot be read.
+ */
+static int original_hash(struct original *o, unsigned long long *full) {
+	pthread_mutex_lock(&o->hash_lock);
+	if(!o->hashed && full_hash(o->path, &o->full) == 0) { o->hashed = 1; }
+	int hashed = o->hashed;
+	*full = o->full;
+	pthread_mutex_unlock(&o->hash_lock);
+	return hashed ? 0 : -1;
+}
+
+/*
+ * Returns the original that file 'index' is a copy of and clears 'created', or
+ * makes a new one, sets 'created', and leaves the parsing to the caller. Files
+ * that cannot be hashed always get an original of their own. Returns NULL if
+ * out of memory.
+ */
+static struct original* find_original(struct dedup *d, int index, int *created) {
+	char *path = d->files[index];
+	unsigned long long key[2], full, other;
+	struct original *o, *head;
+	void **slot;
+	*created = 1;
+	if(quick_key(path, key) == -1) { return new_original(path, index); }
+	pthread_mutex_lock(&d->map_lock);
+	slot = table_slot(d->map, (char*) key, sizeof(key));
+	if(slot == NULL || *slot == NULL) {
+		o = new_original(path, index);
+		if(slot != NULL) { *slot = o; }
+		pthread_mutex_unlock(&d->map_lock);
+		return o;
+	}
+	head = *slot;
+	pthread_mutex_unlock(&d->map_lock);
+	// The quick hashes collided, so compare whole files. The hashing is done
+	// without 'map_lock', so other files are not held up behind it.
+	if(full_hash(path, &full) == -1) { return new_original(path, index); }
+	for(o = head; o != NULL; o = o->next) {
+		if(original_hash(o, &other) == 0 && other == full) { break; }
+	}
+	if(o == NULL) {
+		pthread_mutex_lock(&d->map_lock);
+		slot = table_slot(d->map, (char*) key, sizeof(key));
+		// Originals added since 'head' was read were hashed when they were
+		// added, so checking them holds no one up. The key is already in the
+		// table, so 'slot' is not NULL.
+		for(o = *slot; o != head && o->full != full; o = o->next);
+		if(o == head && (o = new_original(path, index)) != NULL) {
+			o->full = full;
+			o->hashed = 1;
+			o->next = *slot;
+			*slot = o;
+		} else if(o != NULL) {
+			*created = 0;
+		}
+		pthread_mutex_unlock(&d->map_lock);
+	} else {
+		*created = 0;
+	}
+	if(!*created && !same_content(path, o->path)) {
+		*created = 1;
+		return new_original(path, index);
+	}
+	return o;
+}
+
+static void on_begin(struct report *r, const char *filename) {
+}
+
+static void on_end(struct report *r, const char *filename, int rv) {
+	struct original *o = r->ctx;
+	o->rv = rv;
+}
+
+/*
+ * Prints the results of the files that are done, in the order given, up to the
+ * first one that is not. A copy is printed as its original was, after a line
+ * naming the first file with the same bytes. Called with 'out_lock' held.
+ */
+static void print_ready(struct dedup *d) {
+	struct report r = { .out = stdout };
+	for(; d->next < d->nfiles; d->next++) {
+		struct result *res = &d->results[d->next];
+		struct original *o = res->original;
+		char *filename = d->files[d->next];
+		if(!res->ready || (o != NULL && !o->parsed)) { break; }
+		report_begin(&r, filename);
+		if(o == NULL) {
+			report_end(&r, filename, -1);
+			continue;
+		}
+		if(o->first == -1) {
+			o->first = d->next;
+		} else {
+			report_field(&r, "Duplicate of", d->files[o->first], strlen(d->files[o->first]));
+			d->duplicates++;
+		}
+		fwrite(o->body, 1, o->length, stdout);
+		report_end(&r, filename, o->rv);
+	}
+}
+
+static void dedup_worker(int worker, void *item, void *ctx) {
+	struct dedup *d = ctx;
+	int index = (char**) item - d->files, created;
+	struct original *o = find_original(d, index, &created);
+	if(o != NULL && created) {
+		FILE *mem = open_memstream(&o->body, &o->length);
+		if(mem != NULL) {
+			struct report r = { .out = mem, .begin = on_begin, .end = on_end, .ctx = o };
+			analyze(o->path, &r);
+			fclose(mem);
+		} else {
+			o->rv = -1;
+		}
+	}
+	pthread_mutex_lock(&d->out_lock);
+	if(o != NULL && created) { o->parsed = 1; }
+	d->results[index].original = o;
+	d->results[index].ready = 1;
+	print_ready(d);
+	pthread_mutex_unlock(&d->out_lock);
+}
+
+/*
+ * Analyzes 'files' on 'threads' workers like a plain run, in the same order,
+ * but parses each distinct content only once. Files are told apart by their
+ * size and the hash of their ends, and only when those match by the hash of
+ * their whole contents and then their bytes. Returns 0 on success, -1
+ * otherwise.
+ */
+int dedup_files(char **files, int nfiles, int threads) {
+	int i;
+	struct dedup d = { .files = files, .nfiles = nfiles };
+	d.map = table_create();
+	d.results = calloc(nfiles + 1, sizeof(struct result));
+	if(d.map == NULL || d.results == NULL) {
+		if(d.map != NULL) { table_free(d.map, NULL); }
+		free(d.results);
+		return -1;
+	}
+	pthread_mutex_init(&d.map_lock, NULL);
+	pthread_mutex_init(&d.out_lock, NULL);
+	struct pool *p = pool_create(threads, dedup_worker, &d);
+	if(p != NULL) {
+		for(i = 0; i < nfiles; i++) {
+			if(pool_submit(p, &files[i]) == -1) { break; }
+		}
+		pool_finish(p);
+	}
+	fprintf(stderr, "Deduplicated: %d of %d files were copies\n", d.duplicates, nfiles);
+	// Every original belongs to the file that created it. Forget the copies
+	// first, since their original may be freed before they are reached.
+	for(i = 0; i < nfiles; i++) {
+		if(d.results[i].original != NULL && d.results[i].original->owner != i) { d.results[i].original = NULL; }
+	}
+	for(i = 0; i < nfiles; i++) {
+		if(d.results[i].original != NULL) { free_original(d.results[i].original); }
+	}
+	table_free(d.map, NULL);
+	pthread_mutex_destroy(&d.map_lock);
+	pthread_mutex_destroy(&d.out_lock);
+	free(d.results);
+	return p != NULL && d.next == nfiles ? 0 : -1;
+}
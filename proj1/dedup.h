@@ -0,0 +1,6 @@
+#ifndef DEDUP_H_GUARD
+#define DEDUP_H_GUARD
+
+int dedup_files(char **files, int nfiles, int threads);
+
+#endif
@@ -0,0 +1,697 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "index.h"
+#include "analyze.h"
+#include "pool.h"
+#include "stamp.h"
+#include "table.h"
+
+/*
+ * An index is a directory of immutable segment files, seg-NNNNNN.idx, one per
+ * build. A file indexed again in a later segment supersedes its older entries.
+ * Each segment holds, after its header:
+ *
+ *   docs      one struct idx_doc per file, sorted by path
+ *   terms     one struct idx_term per distinct "key\0value", sorted bytewise
+ *   postings  the ascending doc numbers of each term, back to back
+ *   stamps    one struct idx_stamp per dated file, sorted by time
+ *   strings   the paths and terms the other sections point into
+ */
+#define IDX_MAGIC "IMGIDX1\n"
+
+struct idx_header {
+	char magic[8];
+	uint32_t ndocs;
+	uint32_t nterms;
+	uint32_t npostings;
+	uint32_t nstamps;
+	uint64_t docs_off;
+	uint64_t terms_off;
+	uint64_t postings_off;
+	uint64_t stamps_off;
+	uint64_t strings_off;
+	uint64_t strings_len;
+};
+
+struct idx_doc {
+	uint64_t path_off;
+	uint32_t path_len;
+	uint32_t pad;
+};
+
+struct idx_term {
+	uint64_t term_off;
+	uint32_t term_len;
+	uint32_t npostings;
+	uint64_t postings_off;
+};
+
+struct idx_stamp {
+	int64_t stamp;
+	uint32_t doc;
+	uint32_t pad;
+};
+
+// A file as collected by a worker while building.
+struct doc {
+	char *path;
+	// "key\0value" for each field, unless the file could not be read.
+	char **terms;
+	int *lens;
+	int nterms;
+	long long stamp;
+};
+
+// The files one worker has analyzed.
+struct collector {
+	struct doc *docs;
+	int ndocs;
+	int size;
+	// Set while the current file has no doc, as it could not be added, and
+	// the number of files that went that way.
+	int dropped;
+	int lost;
+	// I/O totals when files are read with pread planning.
+	struct io_stats io;
+};
+
+// The doc numbers of one term while building.
+struct postings {
+	uint32_t *ids;
+	int n;
+	int size;
+};
+
+// A memory-mapped segment.
+struct segment {
+	unsigned char *map;
+	size_t size;
+	struct idx_header *h;
+	struct idx_doc *docs;
+	struct idx_term *terms;
+	uint32_t *postings;
+	struct idx_stamp *stamps;
+	const char *strings;
+};
+
+static void free_doc(struct doc *d) {
+	int i;
+	for(i = 0; i < d->nterms; i++) { free(d->terms[i]); }
+	free(d->terms);
+	free(d->lens);
+	free(d->path);
+}
+
+/*
+ * Starts a doc for the file. If that fails, its fields are dropped rather than
+ * added to the previous file's doc.
+ */
+static void on_begin(struct report *r, const char *filename) {
+	struct collector *c = r->ctx;
+	c->dropped = 1;
+	c->lost++;
+	if(c->ndocs == c->size) {
+		int size = c->size ? c->size * 2 : 64;
+		struct doc *docs = realloc(c->docs, size * sizeof(struct doc));
+		if(docs == NULL) { return; }
+		c->docs = docs;
+		c->size = size;
+	}
+	struct doc *d = &c->docs[c->ndocs];
+	memset(d, 0, sizeof(struct doc));
+	if((d->path = strdup(filename)) == NULL) { return; }
+	c->ndocs++;
+	c->dropped = 0;
+	c->lost--;
+}
+
+static void on_field(struct report *r, const char *key, const char *value, int length) {
+	struct collector *c = r->ctx;
+	if(c->dropped) { return; }
+	struct doc *d = &c->docs[c->ndocs - 1];
+	int keylen = strlen(key);
+	char **terms = realloc(d->terms, (d->nterms + 1) * sizeof(char*));
+	if(terms == NULL) { return; }
+	d->terms = terms;
+	int *lens = realloc(d->lens, (d->nterms + 1) * sizeof(int));
+	if(lens == NULL) { return; }
+	d->lens = lens;
+	char *term = malloc(keylen + 1 + length + 1);
+	if(term == NULL) { return; }
+	memcpy(term, key, keylen + 1);
+	memcpy(term + keylen + 1, value, length);
+	term[keylen + 1 + length] = 0;
+	d->terms[d->nterms] = term;
+	d->lens[d->nterms] = keylen + 1 + length;
+	d->nterms++;
+}
+
+/*
+ * Drops the fields of unreadable files, which may be partial, and dates the
+ * rest. Unreadable files stay in the index so they still supersede older
+ * entries.
+ */
+static void on_end(struct report *r, const char *filename, int rv) {
+	struct collector *c = r->ctx;
+	int i, k;
+	if(c->dropped) { return; }
+	struct doc *d = &c->docs[c->ndocs - 1];
+	if(rv < 0) {
+		for(i = 0; i < d->nterms; i++) { free(d->terms[i]); }
+		d->nterms = 0;
+		return;
+	}
+	char stamp[STAMP_LEN];
+	for(k = 0; k < NSTAMP_KEYS && d->stamp == 0; k++) {
+		for(i = 0; i < d->nterms; i++) {
+			if(strcmp(d->terms[i], STAMP_KEYS[k]) == 0 &&
+				stamp_normalize(d->terms[i] + strlen(STAMP_KEYS[k]) + 1, stamp) == 0) {
+				d->stamp = stamp_number(stamp);
+				break;
+			}
+		}
+	}
+}
+
+static void on_io(struct report *r, const char *filename, struct io_stats *io) {
+	struct collector *c = r->ctx;
+	c->io.bytes_read += io->bytes_read;
+	c->io.file_size += io->file_size;
+	c->io.reads += io->reads;
+}
+
+static void index_worker(int worker, void *item, void *ctx) {
+	struct collector *c = &((struct collector*) ctx)[worker];
+	struct report r = { .begin = on_begin, .field = on_field, .end = on_end, .io = on_io, .ctx = c };
+	analyze(item, &r);
+}
+
+static int compare_docs(const void *x, const void *y) {
+	return strcmp(((struct doc*) x)->path, ((struct doc*) y)->path);
+}
+
+/*
+ * Compares two byte strings, a shorter one first when it is a prefix of the
+ * other.
+ */
+static int compare_bytes(const char *a, int alen, const char *b, int blen) {
+	int c = memcmp(a, b, alen < blen ? alen : blen);
+	if(c != 0) { return c; }
+	return alen < blen ? -1 : alen > blen;
+}
+
+// A term copied out of the build table for sorting.
+struct term_row {
+	const char *term;
+	int length;
+	struct postings *p;
+};
+
+struct term_rows {
+	struct term_row *rows;
+	int n;
+};
+
+static void collect_term(const char *key, int length, void *value, void *ctx) {
+	struct term_rows *t = ctx;
+	t->rows[t->n].term = key;
+	t->rows[t->n].length = length;
+	t->rows[t->n].p = value;
+	t->n++;
+}
+
+static int compare_term_rows(const void *x, const void *y) {
+	const struct term_row *a = x, *b = y;
+	return compare_bytes(a->term, a->length, b->term, b->length);
+}
+
+static int compare_stamps(const void *x, const void *y) {
+	const struct idx_stamp *a = x, *b = y;
+	if(a->stamp != b->stamp) { return a->stamp < b->stamp ? -1 : 1; }
+	return a->doc < b->doc ? -1 : a->doc > b->doc;
+}
+
+static void free_postings(void *value) {
+	struct postings *p = value;
+	free(p->ids);
+	free(p);
+}
+
+/*
+ * Returns the number of the newest segment in 'dir', or 0 if it has none.
+ */
+static int last_segment(const char *dir) {
+	int last = 0, n;
+	DIR *d = opendir(dir);
+	if(d == NULL) { return 0; }
+	struct dirent *ent;
+	while((ent = readdir(d)) != NULL) {
+		char end;
+		if(sscanf(ent->d_name, "seg-%d.id%c", &n, &end) == 2 && end == 'x' && n > last) { last = n; }
+	}
+	closedir(d);
+	return last;
+}
+
+/*
+ * Writes 'docs' as a new segment in 'dir'. Returns 0 on success, -1
+ * otherwise.
+ */
+static int write_segment(const char *dir, struct doc *docs, int ndocs) {
+	int i, k, rv = -1;
+	struct table *terms = table_create();
+	struct term_rows rows = { NULL, 0 };
+	struct idx_stamp *stamps = calloc(ndocs + 1, sizeof(struct idx_stamp));
+	uint32_t nstamps = 0, npostings = 0;
+	char tmp[4096], path[4096];
+	FILE *f = NULL;
+	if(terms == NULL || stamps == NULL) { goto done; }
+
+	// Invert the fields into postings; docs are visited in path order, so
+	// each list comes out sorted.
+	for(i = 0; i < ndocs; i++) {
+		for(k = 0; k < docs[i].nterms; k++) {
+			struct postings **p = (struct postings**) table_slot(terms, docs[i].terms[k], docs[i].lens[k]);
+			if(p == NULL) { goto done; }
+			if(*p == NULL && (*p = calloc(1, sizeof(struct postings))) == NULL) { goto done; }
+			// A file with the same field twice is listed once.
+			if((*p)->n > 0 && (*p)->ids[(*p)->n - 1] == i) { continue; }
+			if((*p)->n == (*p)->size) {
+				int size = (*p)->size ? (*p)->size * 2 : 4;
+				uint32_t *ids = realloc((*p)->ids, size * sizeof(uint32_t));
+				if(ids == NULL) { goto done; }
+				(*p)->ids = ids;
+				(*p)->size = size;
+			}
+			(*p)->ids[(*p)->n++] = i;
+			npostings++;
+		}
+		if(docs[i].stamp != 0) {
+			stamps[nstamps].stamp = docs[i].stamp;
+			stamps[nstamps].doc = i;
+			nstamps++;
+		}
+	}
+	qsort(stamps, nstamps, sizeof(struct idx_stamp), compare_stamps);
+	if((rows.rows = malloc((table_count(terms) + 1) * sizeof(struct term_row))) == NULL) { goto done; }
+	table_each(terms, collect_term, &rows);
+	qsort(rows.rows, rows.n, sizeof(struct term_row), compare_term_rows);
+
+	// Lay out the sections.
+	struct idx_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, IDX_MAGIC, 8);
+	h.ndocs = ndocs;
+	h.nterms = rows.n;
+	h.npostings = npostings;
+	h.nstamps = nstamps;
+	h.docs_off = sizeof(h);
+	h.terms_off = h.docs_off + (uint64_t) ndocs * sizeof(struct idx_doc);
+	h.postings_off = h.terms_off + (uint64_t) rows.n * sizeof(struct idx_term);
+	// Keep the stamps 8-byte aligned.
+	h.stamps_off = (h.postings_off + (uint64_t) npostings * sizeof(uint32_t) + 7) & ~7ULL;
+	h.strings_off = h.stamps_off + (uint64_t) nstamps * sizeof(struct idx_stamp);
+
+	if(mkdir(dir, 0777) != 0 && errno != EEXIST) {
+		perror(dir);
+		goto done;
+	}
+	snprintf(tmp, sizeof(tmp), "%s/.seg-%d.tmp", dir, (int) getpid());
+	if((f = fopen(tmp, "wb")) == NULL) {
+		perror(tmp);
+		goto done;
+	}
+	fwrite(&h, sizeof(h), 1, f);
+	uint64_t strings = 0;
+	for(i = 0; i < ndocs; i++) {
+		struct idx_doc d = { strings, strlen(docs[i].path), 0 };
+		fwrite(&d, sizeof(d), 1, f);
+		strings += d.path_len;
+	}
+	uint64_t postings = 0;
+	for(i = 0; i < rows.n; i++) {
+		struct idx_term t = { strings, rows.rows[i].length, rows.rows[i].p->n, postings };
+		fwrite(&t, sizeof(t), 1, f);
+		strings += t.term_len;
+		postings += t.npostings;
+	}
+	for(i = 0; i < rows.n; i++) {
+		fwrite(rows.rows[i].p->ids, sizeof(uint32_t), rows.rows[i].p->n, f);
+	}
+	if(npostings % 2) { fwrite("\0\0\0\0", 4, 1, f); }
+	fwrite(stamps, sizeof(struct idx_stamp), nstamps, f);
+	for(i = 0; i < ndocs; i++) { fputs(docs[i].path, f); }
+	for(i = 0; i < rows.n; i++) { fwrite(rows.rows[i].term, 1, rows.rows[i].length, f); }
+	// Record the string section's length now that it is known.
+	h.strings_len = strings;
+	if(fseek(f, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, f) != 1) { goto done; }
+	if(fflush(f) != 0 || ferror(f) || fsync(fileno(f)) != 0) {
+		perror(tmp);
+		goto done;
+	}
+	// link() never replaces an existing file, so concurrent builds each get
+	// their own segment number.
+	for(i = last_segment(dir) + 1; ; i++) {
+		snprintf(path, sizeof(path), "%s/seg-%06d.idx", dir, i);
+		if(link(tmp, path) == 0) { break; }
+		if(errno != EEXIST) {
+			perror(path);
+			goto done;
+		}
+	}
+	fprintf(stderr, "Indexed %d files, %d terms into %s\n", ndocs, rows.n, path);
+	rv = 0;
+done:
+	if(f != NULL) {
+		fclose(f);
+		unlink(tmp);
+	}
+	free(rows.rows);
+	free(stamps);
+	if(terms != NULL) { table_free(terms, free_postings); }
+	return rv;
+}
+
+/*
+ * Analyzes 'files' on 'threads' workers and appends their fields to the
+ * index in 'dir' as a new segment. Returns 0 on success, -1 otherwise.
+ */
+int index_files(char **files, int nfiles, const char *dir, int threads) {
+	int i, k, n = 0, rv = -1;
+	struct collector *cs = calloc(threads, sizeof(struct collector));
+	struct doc *docs = NULL;
+	if(cs == NULL) { return -1; }
+	struct pool *p = pool_create(threads, index_worker, cs);
+	if(p == NULL) { goto done; }
+	for(i = 0; i < nfiles; i++) {
+		if(pool_submit(p, files[i]) == -1) { break; }
+	}
+	pool_finish(p);
+	if(i < nfiles) { goto done; }
+
+	// Gather every worker's files into one path-sorted list.
+	struct io_stats io = { 0 };
+	int lost = 0;
+	for(i = 0; i < threads; i++) {
+		n += cs[i].ndocs;
+		lost += cs[i].lost;
+		io.bytes_read += cs[i].io.bytes_read;
+		io.file_size += cs[i].io.file_size;
+		io.reads += cs[i].io.reads;
+	}
+	if(io.reads > 0) {
+		fprintf(stderr, "Read: %lld of %lld bytes in %d reads\n", io.bytes_read, io.file_size, io.reads);
+	}
+	// A segment missing files would leave their older entries current.
+	if(lost > 0) {
+		fprintf(stderr, "Out of memory: %d files were not indexed\n", lost);
+		n = 0;
+		goto done;
+	}
+	if((docs = malloc((n + 1) * sizeof(struct doc))) == NULL) { goto done; }
+	n = 0;
+	for(i = 0; i < threads; i++) {
+		memcpy(docs + n, cs[i].docs, cs[i].ndocs * sizeof(struct doc));
+		n += cs[i].ndocs;
+		cs[i].ndocs = 0;
+	}
+	qsort(docs, n, sizeof(struct doc), compare_docs);
+	// A path given twice is indexed once.
+	for(i = k = 0; i < n; i++) {
+		if(k > 0 && strcmp(docs[k - 1].path, docs[i].path) == 0) {
+			free_doc(&docs[i]);
+		} else {
+			docs[k++] = docs[i];
+		}
+	}
+	n = k;
+	rv = write_segment(dir, docs, n);
+done:
+	for(i = 0; i < n; i++) { free_doc(&docs[i]); }
+	free(docs);
+	for(i = 0; i < threads; i++) {
+		for(k = 0; k < cs[i].ndocs; k++) { free_doc(&cs[i].docs[k]); }
+		free(cs[i].docs);
+	}
+	free(cs);
+	return rv;
+}
+
+/*
+ * Maps the segment at 'path' and checks that every offset in it stays inside
+ * the file. Returns 0 on success, -1 otherwise.
+ */
+static int open_segment(const char *path, struct segment *s) {
+	uint64_t i;
+	memset(s, 0, sizeof(struct segment));
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if(fd < 0) { return -1; }
+	if(fstat(fd, &st) != 0 || st.st_size < sizeof(struct idx_header)) {
+		close(fd);
+		return -1;
+	}
+	s->size = st.st_size;
+	s->map = mmap(NULL, s->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(s->map == MAP_FAILED) {
+		s->map = NULL;
+		return -1;
+	}
+	struct idx_header *h = s->h = (struct idx_header*) s->map;
+	if(memcmp(h->magic, IDX_MAGIC, 8) != 0 ||
+		h->docs_off + (uint64_t) h->ndocs * sizeof(struct idx_doc) > s->size ||
+		h->terms_off + (uint64_t) h->nterms * sizeof(struct idx_term) > s->size ||
+		h->postings_off + (uint64_t) h->npostings * sizeof(uint32_t) > s->size ||
+		h->stamps_off + (uint64_t) h->nstamps * sizeof(struct idx_stamp) > s->size ||
+		h->strings_off > s->size || h->strings_len > s->size - h->strings_off ||
+		(h->docs_off | h->terms_off | h->stamps_off) % 8 != 0 || h->postings_off % 4 != 0) {
+		goto bad;
+	}
+	s->docs = (struct idx_doc*) (s->map + h->docs_off);
+	s->terms = (struct idx_term*) (s->map + h->terms_off);
+	s->postings = (uint32_t*) (s->map + h->postings_off);
+	s->stamps = (struct idx_stamp*) (s->map + h->stamps_off);
+	s->strings = (const char*) (s->map + h->strings_off);
+	for(i = 0; i < h->ndocs; i++) {
+		if(s->docs[i].path_off + s->docs[i].path_len > h->strings_len) { goto bad; }
+	}
+	for(i = 0; i < h->nterms; i++) {
+		if(s->terms[i].term_off + s->terms[i].term_len > h->strings_len ||
+			s->terms[i].postings_off + s->terms[i].npostings > h->npostings) {
+			goto bad;
+		}
+	}
+	return 0;
+bad:
+	fprintf(stderr, "Corrupt index segment %s\n", path);
+	munmap(s->map, s->size);
+	s->map = NULL;
+	return -1;
+}
+
+/*
+ * Returns the index of the first term in 's' not less than 'term'.
+ */
+static uint32_t lower_bound_term(struct segment *s, const char *term, int length) {
+	uint32_t lo = 0, hi = s->h->nterms;
+	while(lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		struct idx_term *t = &s->terms[mid];
+		if(compare_bytes(s->strings + t->term_off, t->term_len, term, length) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Returns 1 if 's' has a file at 'path', 0 otherwise.
+ */
+static int has_path(struct segment *s, const char *path, int length) {
+	uint32_t lo = 0, hi = s->h->ndocs;
+	while(lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		struct idx_doc *d = &s->docs[mid];
+		int c = compare_bytes(s->strings + d->path_off, d->path_len, path, length);
+		if(c == 0) { return 1; }
+		if(c < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Marks in 'hits' the files of 's' with a term equal to 'term', or starting
+ * with it if 'prefix' is set.
+ */
+static void mark_term(struct segment *s, const char *term, int length, int prefix, unsigned char *hits) {
+	uint32_t i, k;
+	for(i = lower_bound_term(s, term, length); i < s->h->nterms; i++) {
+		struct idx_term *t = &s->terms[i];
+		const char *found = s->strings + t->term_off;
+		if(prefix ? (t->term_len < length || memcmp(found, term, length) != 0)
+			: compare_bytes(found, t->term_len, term, length) != 0) {
+			break;
+		}
+		for(k = 0; k < t->npostings; k++) {
+			uint32_t doc = s->postings[t->postings_off + k];
+			if(doc < s->h->ndocs) { hits[doc] = 1; }
+		}
+		if(!prefix) { break; }
+	}
+}
+
+/*
+ * Marks in 'hits' the files of 's' dated within [from, to].
+ */
+static void mark_stamps(struct segment *s, long long from, long long to, unsigned char *hits) {
+	uint32_t lo = 0, hi = s->h->nstamps;
+	while(lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if(s->stamps[mid].stamp < from) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	for(; lo < s->h->nstamps && s->stamps[lo].stamp <= to; lo++) {
+		if(s->stamps[lo].doc < s->h->ndocs) { hits[s->stamps[lo].doc] = 1; }
+	}
+}
+
+/*
+ * Turns a timestamp given on the command line, e.g. "2003-12-14" or
+ * "2003:12:14 12:01", into the YYYYMMDDhhmmss form, padding missing digits
+ * with 'pad' so that a date alone covers the whole day.
+ */
+static long long parse_query_stamp(const char *s, char pad) {
+	char digits[15];
+	int n = 0;
+	for(; *s && n < 14; s++) {
+		if(*s >= '0' && *s <= '9') { digits[n++] = *s; }
+	}
+	while(n < 14) { digits[n++] = pad; }
+	digits[14] = 0;
+	return atoll(digits);
+}
+
+static int compare_strings(const void *x, const void *y) {
+	return strcmp(*(char**) x, *(char**) y);
+}
+
+/*
+ * Prints the path of every file in the index in 'dir' matching all of
+ * 'conds' and dated within 'from' and 'to', each of which may be NULL. A
+ * condition is "Key=Value", or "Key=Prefix*" to match the start of the value.
+ * Returns 0 on success, -1 otherwise.
+ */
+int index_query(const char *dir, char **conds, int nconds, const char *from, const char *to) {
+	int i, j, c, nsegs = 0, nresults = 0, rv = -1;
+	struct segment *segs = NULL;
+	char **results = NULL;
+	char **names = NULL;
+	long long lo = from ? parse_query_stamp(from, '0') : 0;
+	long long hi = to ? parse_query_stamp(to, '9') : 99999999999999LL;
+	for(c = 0; c < nconds; c++) {
+		if(strchr(conds[c], '=') == NULL) {
+			fprintf(stderr, "Bad condition '%s', expected Key=Value\n", conds[c]);
+			return -1;
+		}
+	}
+
+	// Open the segments, oldest first.
+	DIR *d = opendir(dir);
+	if(d == NULL) {
+		perror(dir);
+		return -1;
+	}
+	struct dirent *ent;
+	int nnames = 0;
+	while((ent = readdir(d)) != NULL) {
+		int n;
+		char end;
+		if(sscanf(ent->d_name, "seg-%d.id%c", &n, &end) != 2 || end != 'x') { continue; }
+		char **more = realloc(names, (nnames + 1) * sizeof(char*));
+		if(more == NULL) { break; }
+		names = more;
+		if((names[nnames] = malloc(strlen(dir) + strlen(ent->d_name) + 2)) == NULL) { break; }
+		sprintf(names[nnames++], "%s/%s", dir, ent->d_name);
+	}
+	closedir(d);
+	qsort(names, nnames, sizeof(char*), compare_strings);
+	if((segs = calloc(nnames + 1, sizeof(struct segment))) == NULL) { goto done; }
+	for(i = 0; i < nnames; i++) {
+		if(open_segment(names[i], &segs[nsegs]) == 0) { nsegs++; }
+	}
+
+	for(i = 0; i < nsegs; i++) {
+		struct segment *s = &segs[i];
+		uint32_t ndocs = s->h->ndocs, doc;
+		unsigned char *hits = malloc(ndocs + 1), *cond = malloc(ndocs + 1);
+		if(hits == NULL || cond == NULL) {
+			free(hits);
+			free(cond);
+			goto done;
+		}
+		memset(hits, 1, ndocs);
+		for(c = 0; c < nconds; c++) {
+			// Build "key\0value" in place of the '='.
+			char *term = strdup(conds[c]);
+			if(term == NULL) { break; }
+			int length = strlen(term), prefix = 0;
+			*strchr(term, '=') = 0;
+			if(length > 0 && term[length - 1] == '*') {
+				prefix = 1;
+				length--;
+			}
+			memset(cond, 0, ndocs);
+			mark_term(s, term, length, prefix, cond);
+			free(term);
+			for(doc = 0; doc < ndocs; doc++) { hits[doc] &= cond[doc]; }
+		}
+		if(from != NULL || to != NULL) {
+			memset(cond, 0, ndocs);
+			mark_stamps(s, lo, hi, cond);
+			for(doc = 0; doc < ndocs; doc++) { hits[doc] &= cond[doc]; }
+		}
+		for(doc = 0; doc < ndocs; doc++) {
+			if(!hits[doc]) { continue; }
+			const char *path = s->strings + s->docs[doc].path_off;
+			int length = s->docs[doc].path_len;
+			// Newer segments hold the current entry for a file.
+			for(j = i + 1; j < nsegs && !has_path(&segs[j], path, length); j++);
+			if(j < nsegs) { continue; }
+			char **more = realloc(results, (nresults + 1) * sizeof(char*));
+			if(more == NULL) { break; }
+			results = more;
+			if((results[nresults] = strndup(path, length)) != NULL) { nresults++; }
+		}
+		free(hits);
+		free(cond);
+	}
+	if(nresults > 0) { qsort(results, nresults, sizeof(char*), compare_strings); }
+	for(i = 0; i < nresults; i++) { printf("%s\n", results[i]); }
+	rv = 0;
+done:
+	for(i = 0; i < nresults; i++) { free(results[i]); }
+	free(results);
+	for(i = 0; i < nsegs; i++) { munmap(segs[i].map, segs[i].size); }
+	free(segs);
+	for(i = 0; i < nnames; i++) { free(names[i]); }
+	free(names);
+	return rv;
+}
@@ -0,0 +1,7 @@
+#ifndef INDEX_H_GUARD
+#define INDEX_H_GUARD
+
+int index_files(char **files, int nfiles, const char *dir, int threads);
+int index_query(const char *dir, char **conds, int nconds, const char *from, const char *to);
+
+#endif
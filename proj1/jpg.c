@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include "jpg.h"
 #include "fpeek.h"
+#include "report.h"
 
 // A valid TIFF file starts with these 6 bytes.
 const static unsigned char TIFF_HEADER[6] = "\x45\x78\x69\x66\x00\x00";
@@ -67,6 +68,13 @@ int parse_short(FILE *f, int big_endian) {
 	}
 }
 
+/*
+ * Returns 0 if 'marker' is within the valid marker range, otherwise -1.
+ */
+int is_marker(int marker) {
+	return (marker >= 0xff01 && marker <= 0xfffe) ? 0 : -1;
+}
+
 /*
  * Parses a chunk marker. Returns the marker if successfully parsed, otherwise
  * -1;
@@ -74,8 +82,7 @@ int parse_short(FILE *f, int big_endian) {
 int parse_marker(FILE *f) {
 	int marker = parse_short(f, 1);
 	if(marker == -1) { return -1; }
-	// Ensure the marker is within the valid marker range.
-	if(marker < 0xff01 || marker > 0xfffe) { return -1; }
+	if(is_marker(marker) == -1) { return -1; }
 	return marker;
 }
 
@@ -191,52 +198,66 @@ int validate_ascii_user_comment(FILE *f, int *count) {
 }
 
 /*
- * Prints the tag name corresponding to 'tagid' and returns 0, or returns -1 if
- * the tagid was not found in TAGIDS.
+ * Returns the tag name corresponding to 'tagid', or NULL if the tagid was not
+ * found in TAGIDS.
  */
-int print_tag_name(int tagid) {
+const char* find_tag_name(int tagid) {
 	int i;
-	for(i = 0; i < sizeof(TAGIDS); i++) {
+	for(i = 0; i < sizeof(TAGIDS) / sizeof(TAGIDS[0]); i++) {
 		if(tagid == TAGIDS[i]) {
-			printf("%s: ", TAG_NAMES[i]);
-			return 0;
+			return TAG_NAMES[i];
 		}
 	}
-	return -1;
+	return NULL;
 }
 
 /*
- * Prints the 4 chars represented within the int.
+ * Reports the 4 chars represented within the int.
  */
-void print_value(unsigned int value) {
-	printf("%.4s\n", (char*) &value);
+void report_value(struct report *r, const char *name, unsigned int value) {
+	report_field(r, name, (char*) &value, 4);
 }
 
 /*
- * Print 'count' bytes from 'f' unless the data is null terminated, in which
- * case, stop printing when we encounter a null character. If we ever each the
- * EOF, return -1, otherwise return 0.
+ * Reads 'count' bytes from 'f' unless the data is null terminated, in which
+ * case, stop reading when we encounter a null character, and reports them as
+ * the value of 'name'. If we ever reach the EOF, return -1, otherwise return 0.
  */
-int print_offset_data(FILE *f, int count) {
-	int c;
-	while(count--) {
+int report_offset_data(FILE *f, int count, struct report *r, const char *name) {
+	int c, size = 64, length = 0;
+	char *value = malloc(size);
+	if(value == NULL) { return -1; }
+	while(count-- > 0) {
 		// If we get to the EOF, then there was an error.
-		if((c = fgetc(f)) == EOF) { return -1; }
-		// If we encounter the null character, stop printing.
+		if((c = fgetc(f)) == EOF) {
+			free(value);
+			return -1;
+		}
+		// If we encounter the null character, stop reading.
 		if(c == 0) { break; }
-		printf("%c", c);
+		// Grow the buffer when it fills up.
+		if(length == size) {
+			char *bigger = realloc(value, size *= 2);
+			if(bigger == NULL) {
+				free(value);
+				return -1;
+			}
+			value = bigger;
+		}
+		value[length++] = c;
 	}
-	// Put each key and value on a new line.
-	printf("\n");
+	report_field(r, name, value, length);
+	free(value);
 	return 0;
 }
 
 /*
  * Parse an IFD section in the PNG and returns the Exif IFD ptr or -1 if parsing
- * fails. Returns an Exif pointer if found. This function is responsible for
- * not modifying the file position when it returns.
+ * fails. Returns an Exif pointer if found. If 'next' is not NULL, it is set to
+ * the offset of the next IFD, or 0 if there is none. This function is
+ * responsible for not modifying the file position when it returns.
  */
-int parse_ifd(FILE *f, int offset) {
+int parse_ifd(FILE *f, int offset, int *next, struct report *r) {
 	// Store the initial position of the file.
 	long int position = ftell(f);
 	// Seek to the offset.
@@ -246,6 +267,7 @@ int parse_ifd(FILE *f, int offset) {
 	if(tags < 0) { return -1; }
 	// Vars for the while loop.
 	int exif_ptr = 0, tagid, datatype, count, offset_or_value;
+	const char *name;
 	// Loop for each tag there should be.
 	while(tags--) {
 		// Read the tagid.
@@ -266,13 +288,13 @@ int parse_ifd(FILE *f, int offset) {
 			exif_ptr = offset_or_value;
 		// Check whether the datatype is either ASCII or undefined.
 		} else if(is_string_datatype(datatype) != -1) {
-			// Print the tag name. If the tagid was not found in TAGIDS, then -1
-			// was returned and we can skip over parsing the value.
-			if(print_tag_name(tagid) != -1) {
+			// Look up the tag name. If the tagid was not found in TAGIDS, then
+			// we can skip over parsing the value.
+			if((name = find_tag_name(tagid)) != NULL) {
 				// If count is less than or equal to 4, then the value can fit
 				// within the offset_or_value field itself.
 				if(count <= 4) {
-					print_value(offset_or_value);
+					report_value(r, name, offset_or_value);
 				// Otherwise offset_or_value defines where the data is located
 				// farther along in the data.
 				} else {
@@ -288,7 +310,7 @@ int parse_ifd(FILE *f, int offset) {
 					// is ASCII, then count is decremented by the length of the
 					// character set identifier.
 					if(is_user_comment(tagid) != 0 || validate_ascii_user_comment(f, &count) == 0) {
-						if(print_offset_data(f, count) == -1) {
+						if(report_offset_data(f, count, r, name) == -1) {
 							return -1;
 						}
 					}
@@ -298,16 +320,69 @@ int parse_ifd(FILE *f, int offset) {
 			}
 		}
 	}
+	// The next IFD offset follows the tags.
+	if(next != NULL && (*next = parse_offset(f)) < 0) { *next = 0; }
 	// Reset the position of the file.
 	if(fseek(f, position, SEEK_SET) != 0) { return -1; }
 	return exif_ptr;
 }
 
 /*
- * Parses an APP1 chunk and returns 0 if successful, otherwise returns -1. This
- * function does not advance the position of the file.
+ * Returns 0 if the tagid corresponds to the JPEGInterchangeFormat tagid, which
+ * holds the offset of the thumbnail, -1 otherwise.
+ */
+int is_thumbnail_offset_tagid(int tagid) {
+	return (tagid == 0x0201) ? 0 : -1;
+}
+
+/*
+ * Returns 0 if the tagid corresponds to the JPEGInterchangeFormatLength tagid,
+ * -1 otherwise.
+ */
+int is_thumbnail_length_tagid(int tagid) {
+	return (tagid == 0x0202) ? 0 : -1;
+}
+
+/*
+ * Parses IFD1 at 'offset' looking for the embedded JPEG thumbnail, and reports
+ * where it is in the file if it lies entirely within the TIFF data, which ends
+ * 'tiff_length' bytes into it. A missing or malformed thumbnail is not an
+ * error. Returns -1 only if the file position cannot be restored. This
+ * function does not modify the file position.
+ */
+int parse_thumbnail_ifd(FILE *f, int offset, int tiff_length, struct report *r) {
+	// Store the initial position of the file, the start of the TIFF data.
+	long int position = ftell(f);
+	int tags = -1, tagid, thumb_offset = -1, thumb_length = -1;
+	if(fseek(f, offset, SEEK_CUR) == 0) { tags = parse_short(f, 0); }
+	while(tags-- > 0) {
+		tagid = parse_short(f, 0);
+		// Skip the datatype and count.
+		if(tagid == -1 || fseek(f, 6, SEEK_CUR) != 0) { break; }
+		int value = parse_offset(f);
+		if(is_thumbnail_offset_tagid(tagid) != -1) {
+			thumb_offset = value;
+		} else if(is_thumbnail_length_tagid(tagid) != -1) {
+			thumb_length = value;
+		}
+	}
+	// The thumbnail has to be past the TIFF header and must not run past the
+	// end of the APP1 chunk.
+	if(thumb_offset >= 8 && thumb_length > 0 && thumb_offset <= tiff_length &&
+		thumb_length <= tiff_length - thumb_offset) {
+		report_thumbnail(r, position + thumb_offset, thumb_length);
+	}
+	// Reset the position of the file.
+	if(fseek(f, position, SEEK_SET) != 0) { return -1; }
+	return 0;
+}
+
+/*
+ * Parses an APP1 chunk of 'length' bytes and returns 0 if successful,
+ * otherwise returns -1. This function does not advance the position of the
+ * file.
  */
-int parse_app1_chunk(FILE *f) {
+int parse_app1_chunk(FILE *f, int length, struct report *r) {
 	// Validate the APP1 header.
 	if(validate_tiff_header(f) == -1) { return -1; }
 	// Validate endianness, always little (0x49 0x49) in this project.
@@ -320,15 +395,22 @@ int parse_app1_chunk(FILE *f) {
 	// Rewind the stream back the beginning of the TIFF file, before the
 	// endianness and magic string fields and the offset.
 	if(fseek(f, -8, SEEK_CUR) != 0) { return -1; }
-	// Parse the 0th IFD.
-	offset = parse_ifd(f, offset);
+	// Parse the 0th IFD, which links to IFD1.
+	int ifd1 = 0;
+	int ifd0 = offset;
+	offset = parse_ifd(f, offset, &ifd1, r);
 	if(offset == -1) { return -1; }
 	// If the offset is zero, it means we didn't find an Exif IFD ptr.
 	if(offset != 0) {
 		// Parse the Exif IFD.
-		offset = parse_ifd(f, offset);
+		offset = parse_ifd(f, offset, NULL, r);
 		if(offset == -1) { return -1; }
 	}
+	// IFD1 only describes the thumbnail, so only look at it when asked to.
+	// An IFD1 pointing back at IFD0 is ignored.
+	if(r->thumbnail != NULL && ifd1 != 0 && ifd1 != ifd0) {
+		if(parse_thumbnail_ifd(f, ifd1, length - sizeof(TIFF_HEADER), r) == -1) { return -1; }
+	}
 	// Rewind to the beginning of the APP1 dection, before the APP1 header.
 	if(fseek(f, -sizeof(TIFF_HEADER), SEEK_CUR) != 0) { return -1; }
 	return 0;
@@ -338,7 +420,7 @@ int parse_app1_chunk(FILE *f) {
  * Parses a chunk. Returns 1 if a chunk is successfully parsed, 0 if it is the
  * last chunk in the file, and -1 if there is an error.
  */
-int parse_jpg_chunk(FILE *f) {
+int parse_jpg_chunk(FILE *f, struct report *r) {
 	// Parse the chunk marker.
 	int marker = parse_marker(f);
 	if(marker == -1) { return -1; }
@@ -360,7 +442,7 @@ int parse_jpg_chunk(FILE *f) {
 				// Parse the APP1 chunk. There is only 1 APP1 chunk in the files
 				// relevant to this project, so if parsing succeeds, just quit,
 				// otherwise error.
-				return (parse_app1_chunk(f) == 0) ? 0 : -1;
+				return (parse_app1_chunk(f, length, r) == 0) ? 0 : -1;
 			}
 			// Ensure the length is nonnegative and forward the position to the
 			// end of the chunk.
@@ -373,12 +455,12 @@ int parse_jpg_chunk(FILE *f) {
 
 /*
  * Analyze a JPG file that contains Exif data.
- * If it is a JPG file, print out all relevant metadata and return 0.
- * If it isn't a JPG file, return -1 and print nothing.
+ * If it is a JPG file, report all relevant metadata to 'r' and return 0.
+ * If it isn't a JPG file, return -1 and report nothing.
  */
-int analyze_jpg(FILE *f) {
+int analyze_jpg(FILE *f, struct report *r) {
 	int c;
-	while((c = parse_jpg_chunk(f))) {
+	while((c = parse_jpg_chunk(f, r))) {
 		if(c < 0) { return -1; }
 	}
     return 0;
@@ -1,6 +1,13 @@
 #ifndef EXIF_H_GUARD
 #define EXIF_H_GUARD
 
-int analyze_jpg(FILE *f);
+#include <stdio.h>
+#include "report.h"
+
+int is_marker(int marker);
+int is_super_chunk(int marker);
+int is_app1_chunk(int marker);
+int parse_app1_chunk(FILE *f, int length, struct report *r);
+int analyze_jpg(FILE *f, struct report *r);
 
 #endif
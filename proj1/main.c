@@ -5,35 +5,70 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include "png.h"
-#include "jpg.h"
+#include <string.h>
+#include <getopt.h>
+#include "analyze.h"
+#include "aggregate.h"
+#include "dedup.h"
+#include "index.h"
+#include "pool.h"
+#include "shard.h"
+#include "thumbs.h"
+#include "verify.h"
+#include "watch.h"
 
-int try_analyze_png_file(char *filename) {
-    FILE *f = fopen(filename, "r");
-    if (f == NULL)
-        return -1;
-    int rv = analyze_png(f);
-    fclose(f);
-    return rv;
+static void usage(char *program) {
+    fprintf(stderr,
+        "Usage: %s [options] file...   (\"-\" reads standard input)\n"
+        "       %s --watch DIR [options]\n"
+        "       %s query INDEX [--from TIME] [--to TIME] [KEY=VALUE | KEY=PREFIX*]...\n"
+        "       %s merge SHARD-OUTPUT...\n"
+        "\n"
+        "  -w, --watch DIR    analyze files as they arrive under DIR\n"
+        "  -j, --jobs N       number of analysis threads (default: CPUs)\n"
+        "  -d, --window MS    milliseconds to batch new files for (default: 50)\n"
+        "  -a, --aggregate    print only a summary of all files\n"
+        "  -g, --group-by K,..  keys to summarize by, each optionally cut to its\n"
+        "                     first N characters as KEY:N (default: Make,Model)\n"
+        "  -t, --top K        list the K most common values of each key (default: 5)\n"
+        "  -k, --top-keys K,..  keys to list common values of, each optionally cut\n"
+        "                     as KEY:N (default: the --group-by keys)\n"
+        "  -p, --pread        read only the needed parts of each file with pread\n"
+        "  -b, --io-budget N  with --pread, give up on a file after N bytes\n"
+        "  -v, --verify       check every chunk CRC and the image data stream\n"
+        "  -i, --index INDEX  add the files' metadata to the index directory INDEX\n"
+        "  -s, --shard I/N    only analyze the I-th of N shards of the files, in order\n"
+        "  -o, --output FILE  write a mergeable shard output to FILE, resuming from\n"
+        "                     its checkpoint FILE.ckpt if there is one\n"
+        "  -c, --checkpoint-every N  save the checkpoint every N files (default: 64)\n"
+        "  -T, --thumbs DIR   copy each JPG's embedded Exif thumbnail into DIR\n"
+        "  -D, --dedup        parse identical files once and mark the copies\n",
+        program, program, program, program);
 }
 
-int try_analyze_jpg_file(char *filename) {
-    FILE *f = fopen(filename, "r");
-    if (f == NULL)
-        return -1;
-    int rv = analyze_jpg(f);
-    fclose(f);
-    return rv;
-}
-
-int analyze(char *filename) {
-    int rv;
-    printf("File: %s\n", filename);
-    rv = try_analyze_png_file(filename);
-    if (rv < 0) {
-        rv = try_analyze_jpg_file(filename);
-    }
-    return rv;
+/*
+ * Answers a query against an index built with --index.
+ */
+static int query_main(int argc, char** argv) {
+    static struct option options[] = {
+        {"from", required_argument, NULL, 'f'},
+        {"to",   required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0}
+    };
+    char *from = NULL, *to = NULL;
+    int c;
+    while ((c = getopt_long(argc, argv, "f:t:", options, NULL)) != -1) {
+        switch (c) {
+        case 'f': from = optarg; break;
+        case 't': to = optarg; break;
+        default:
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        return 1;
+    }
+    return index_query(argv[optind], argv + optind + 1, argc - optind - 1, from, to) == 0 ? 0 : 1;
 }
 
 /*
@@ -42,11 +77,106 @@ int analyze(char *filename) {
  * Usage: <program> bar.png baf.png fred.jpg sally.jpg
  */
 int main(int argc, char** argv) {
-    int i;
-    for (i=1; i<argc; i++) {
-        if (analyze(argv[i]) < 0) {
-            printf("Error reading file %s\n", argv[i]);
+    static struct option options[] = {
+        {"watch",  required_argument, NULL, 'w'},
+        {"jobs",   required_argument, NULL, 'j'},
+        {"window", required_argument, NULL, 'd'},
+        {"aggregate", no_argument,    NULL, 'a'},
+        {"group-by", required_argument, NULL, 'g'},
+        {"top",    required_argument, NULL, 't'},
+        {"top-keys", required_argument, NULL, 'k'},
+        {"pread",  no_argument,       NULL, 'p'},
+        {"io-budget", required_argument, NULL, 'b'},
+        {"verify", no_argument,       NULL, 'v'},
+        {"index",  required_argument, NULL, 'i'},
+        {"shard",  required_argument, NULL, 's'},
+        {"output", required_argument, NULL, 'o'},
+        {"checkpoint-every", required_argument, NULL, 'c'},
+        {"thumbs", required_argument, NULL, 'T'},
+        {"dedup",  no_argument,       NULL, 'D'},
+        {NULL, 0, NULL, 0}
+    };
+    char *watch_dir = NULL, *group_by = "Make,Model", *top_keys = NULL, *index_dir = NULL;
+    char *shard = "0/1", *output = NULL, *thumbs_dir = NULL;
+    int jobs = pool_default_threads(), window = 50, aggregate = 0, top = 5;
+    int use_pread = 0, verify = 0, dedup = 0, every = 64, shard_index = 0, shard_count = 1;
+    long long budget = -1;
+    int c, i;
+    if (argc > 1 && strcmp(argv[1], "query") == 0) {
+        if (query_main(argc - 1, argv + 1) != 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "merge") == 0) {
+        return shard_merge(argv + 2, argc - 2) == 0 ? 0 : 1;
+    }
+    while ((c = getopt_long(argc, argv, "w:j:d:ag:t:k:pb:vi:s:o:c:T:D", options, NULL)) != -1) {
+        switch (c) {
+        case 'w': watch_dir = optarg; break;
+        case 'j': jobs = atoi(optarg); break;
+        case 'd': window = atoi(optarg); break;
+        case 'a': aggregate = 1; break;
+        case 'g': group_by = optarg; break;
+        case 't': top = atoi(optarg); break;
+        case 'k': top_keys = optarg; break;
+        case 'p': use_pread = 1; break;
+        case 'b': use_pread = 1; budget = atoll(optarg); break;
+        case 'v': verify = 1; break;
+        case 'i': index_dir = optarg; break;
+        case 's': shard = optarg; break;
+        case 'o': output = optarg; break;
+        case 'c': every = atoi(optarg); break;
+        case 'T': thumbs_dir = optarg; break;
+        case 'D': dedup = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
         }
     }
+    if (jobs < 1 || window < 0 || top < 0 || every < 1 ||
+        shard_parse(shard, &shard_index, &shard_count) != 0 ||
+        (aggregate + verify + dedup + (watch_dir != NULL) + (index_dir != NULL) + (output != NULL) +
+         (thumbs_dir != NULL) > 1)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (use_pread) {
+        analyze_use_pread(budget);
+    }
+
+    if (watch_dir != NULL) {
+        return watch_directory(watch_dir, jobs, window) == 0 ? 0 : 1;
+    }
+
+    char **files = argv + optind;
+    int nfiles = argc - optind;
+    if (shard_count > 1 || output != NULL) {
+        nfiles = shard_select(files, nfiles, shard_index, shard_count);
+    }
+    if (output != NULL) {
+        return shard_run(files, nfiles, shard, output, every) == 0 ? 0 : 1;
+    }
+    if (thumbs_dir != NULL) {
+        return thumbs_files(files, nfiles, thumbs_dir, jobs) == 0 ? 0 : 1;
+    }
+    if (index_dir != NULL) {
+        return index_files(files, nfiles, index_dir, jobs) == 0 ? 0 : 1;
+    }
+    if (verify) {
+        return verify_files(files, nfiles, jobs) == 0 ? 0 : 1;
+    }
+    if (aggregate) {
+        return aggregate_files(files, nfiles, group_by, top_keys, top, jobs) == 0 ? 0 : 1;
+    }
+    if (dedup) {
+        return dedup_files(files, nfiles, jobs) == 0 ? 0 : 1;
+    }
+
+    struct report r = { .out = stdout };
+    for (i=0; i<nfiles; i++) {
+        analyze(files[i], &r);
+    }
     return 0;
 }
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "planio.h"
+
+// The first read covers this much of the file.
+#define HEADER_WINDOW 65536
+// Reads of JPEG segment headers past the header window, and of anything the
+// parsers ask for that was not planned, cover this much. PNG chunk headers
+// are read alone, since the chunks between them are mostly IDAT.
+#define PROBE 4096
+#define PNG_CHUNK_HEADER 8
+// Planned ranges closer together than this are read together.
+#define COALESCE_GAP 4096
+
+// A range of the file that has been read.
+struct extent {
+	long long offset;
+	long long length;
+	unsigned char *data;
+};
+
+struct planned_file {
+	int fd;
+	long long budget;
+	struct io_stats stats;
+	// Sorted by offset and never overlapping.
+	struct extent *extents;
+	int nextents;
+};
+
+// A range the parsers will need.
+struct range {
+	long long start;
+	long long end;
+};
+
+// A stream's position within a planned file.
+struct cursor {
+	struct planned_file *pf;
+	long long pos;
+};
+
+/*
+ * Returns the index of the first extent ending after 'offset'.
+ */
+static int find_extent(struct planned_file *pf, long long offset) {
+	int lo = 0, hi = pf->nextents;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(pf->extents[mid].offset + pf->extents[mid].length <= offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Returns how many bytes from 'offset' on are already read, or 0 if 'offset'
+ * itself is not.
+ */
+static long long cached_length(struct planned_file *pf, long long offset) {
+	long long length = 0;
+	int i = find_extent(pf, offset);
+	// Adjacent extents count as one run.
+	while(i < pf->nextents && pf->extents[i].offset <= offset + length) {
+		length = pf->extents[i].offset + pf->extents[i].length - offset;
+		i++;
+	}
+	return length;
+}
+
+/*
+ * Stores a copy of the bytes in 'data' that fall into gaps between the
+ * extents already read. Returns 0 on success, -1 if out of memory.
+ */
+static int store(struct planned_file *pf, long long offset, unsigned char *data, long long length) {
+	long long done = 0;
+	while(done < length) {
+		done += cached_length(pf, offset + done);
+		if(done >= length) { break; }
+		// The gap runs up to the next extent or the end of the data.
+		int i = find_extent(pf, offset + done);
+		long long gap = length - done;
+		if(i < pf->nextents && pf->extents[i].offset - (offset + done) < gap) {
+			gap = pf->extents[i].offset - (offset + done);
+		}
+		struct extent *extents = realloc(pf->extents, (pf->nextents + 1) * sizeof(struct extent));
+		if(extents == NULL) { return -1; }
+		pf->extents = extents;
+		unsigned char *copy = malloc(gap);
+		if(copy == NULL) { return -1; }
+		memcpy(copy, data + done, gap);
+		memmove(&extents[i + 1], &extents[i], (pf->nextents - i) * sizeof(struct extent));
+		extents[i].offset = offset + done;
+		extents[i].length = gap;
+		extents[i].data = copy;
+		pf->nextents++;
+		done += gap;
+	}
+	return 0;
+}
+
+/*
+ * Reads [offset, offset + length) of the file with one pread, trimmed to the
+ * end of the file and to the I/O budget, and keeps whatever part of it was not
+ * read already. Returns 0 on success, -1 if nothing could be read.
+ */
+static int read_range(struct planned_file *pf, long long offset, long long length) {
+	// Skip over any part that is already read at the front.
+	long long have = cached_length(pf, offset);
+	offset += have;
+	length -= have;
+	if(offset + length > pf->stats.file_size) { length = pf->stats.file_size - offset; }
+	if(length <= 0) { return 0; }
+	if(pf->budget >= 0 && pf->stats.bytes_read + length > pf->budget) {
+		length = pf->budget - pf->stats.bytes_read;
+		if(length <= 0) {
+			pf->stats.over_budget = 1;
+			return -1;
+		}
+	}
+	unsigned char *data = malloc(length);
+	if(data == NULL) { return -1; }
+	ssize_t n;
+	do {
+		n = pread(pf->fd, data, length, offset);
+	} while(n < 0 && errno == EINTR);
+	pf->stats.reads++;
+	if(n <= 0) {
+		free(data);
+		return -1;
+	}
+	pf->stats.bytes_read += n;
+	int rv = store(pf, offset, data, n);
+	free(data);
+	return rv;
+}
+
+/*
+ * Copies up to 'length' already read bytes at 'offset' into 'buf' and returns
+ * how many were copied.
+ */
+static long long copy_cached(struct planned_file *pf, long long offset, unsigned char *buf, long long length) {
+	long long done = 0;
+	int i = find_extent(pf, offset);
+	// Copy across adjacent extents until a gap or 'length' is reached.
+	while(done < length && i < pf->nextents && pf->extents[i].offset <= offset + done) {
+		struct extent *e = &pf->extents[i++];
+		long long n = e->offset + e->length - (offset + done);
+		if(n > length - done) { n = length - done; }
+		memcpy(buf + done, e->data + (offset + done - e->offset), n);
+		done += n;
+	}
+	return done;
+}
+
+/*
+ * Makes sure [offset, offset + length) is read, reading at least 'probe'
+ * bytes so that neighbouring headers can come along. Returns 0 on success, -1
+ * otherwise.
+ */
+static int need(struct planned_file *pf, long long offset, long long length, long long probe) {
+	if(cached_length(pf, offset) >= length) { return 0; }
+	if(read_range(pf, offset, length > probe ? length : probe) == -1) { return -1; }
+	return cached_length(pf, offset) >= length ? 0 : -1;
+}
+
+/*
+ * Appends [start, end) to 'ranges'. Returns 0 on success, -1 otherwise.
+ */
+static int add_range(struct range **ranges, int *n, long long start, long long end) {
+	struct range *r = realloc(*ranges, (*n + 1) * sizeof(struct range));
+	if(r == NULL) { return -1; }
+	r[*n].start = start;
+	r[*n].end = end;
+	*ranges = r;
+	(*n)++;
+	return 0;
+}
+
+/*
+ * Walks the PNG chunk headers, adding the tEXt, zTXt and tIME chunks to
+ * 'ranges'. Everything else, IDAT included, is stepped over by its length.
+ */
+static void plan_png(struct planned_file *pf, struct range **ranges, int *n) {
+	long long offset = 8;
+	unsigned char header[8];
+	while(need(pf, offset, PNG_CHUNK_HEADER, PNG_CHUNK_HEADER) == 0) {
+		copy_cached(pf, offset, header, 8);
+		long long length = ((long long) header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+		// Length, type, data and CRC, plus the next chunk's header so the
+		// parser can tell whether this was the last chunk.
+		long long end = offset + 12 + length;
+		if(length > 0x7fffffff || end > pf->stats.file_size) { break; }
+		if(memcmp(header + 4, "tEXt", 4) == 0 || memcmp(header + 4, "zTXt", 4) == 0 ||
+			memcmp(header + 4, "tIME", 4) == 0) {
+			if(add_range(ranges, n, offset, end + 1) == -1) { break; }
+		}
+		if(memcmp(header + 4, "IEND", 4) == 0) { break; }
+		offset = end;
+	}
+}
+
+/*
+ * Walks the JPEG segment headers up to the APP1 segment, which is the last
+ * one the parser reads, and adds it to 'ranges'. Planning stops at the start
+ * of scan data, which is never read ahead.
+ */
+static void plan_jpg(struct planned_file *pf, struct range **ranges, int *n) {
+	long long offset = 0;
+	unsigned char header[4];
+	while(need(pf, offset, 2, PROBE) == 0) {
+		copy_cached(pf, offset, header, 2);
+		int marker = (header[0] << 8) | header[1];
+		if(header[0] != 0xff || marker == 0xffda || marker == 0xffd9) { break; }
+		// Markers without a length.
+		if(marker >= 0xffd0 && marker <= 0xffd8) {
+			offset += 2;
+			continue;
+		}
+		if(need(pf, offset, 4, PROBE) == -1) { break; }
+		copy_cached(pf, offset, header, 4);
+		long long end = offset + 2 + ((header[2] << 8) | header[3]);
+		if(end > pf->stats.file_size) { break; }
+		if(marker == 0xffe1) {
+			add_range(ranges, n, offset, end);
+			break;
+		}
+		offset = end;
+	}
+}
+
+static int compare_ranges(const void *x, const void *y) {
+	const struct range *a = x, *b = y;
+	return a->start < b->start ? -1 : a->start > b->start;
+}
+
+/*
+ * Reads the planned ranges, merging those closer than COALESCE_GAP into one
+ * read each.
+ */
+static void read_ranges(struct planned_file *pf, struct range *ranges, int n) {
+	int i, j;
+	if(n == 0) { return; }
+	qsort(ranges, n, sizeof(struct range), compare_ranges);
+	for(i = 0; i < n; i = j) {
+		long long start = ranges[i].start, end = ranges[i].end;
+		// Leave out what is already read at the front.
+		start += cached_length(pf, start);
+		for(j = i + 1; j < n && ranges[j].start - end <= COALESCE_GAP; j++) {
+			if(ranges[j].end > end) { end = ranges[j].end; }
+		}
+		if(start < end && read_range(pf, start, end - start) == -1) { return; }
+	}
+}
+
+/*
+ * Opens 'filename' and reads the parts of it the parsers will need: a header
+ * window first, then chunk headers past it and coalesced reads of the
+ * metadata chunks. No more than 'budget' bytes are ever read, unless it is
+ * negative. Returns NULL if the file cannot be opened.
+ */
+struct planned_file* planio_open(const char *filename, long long budget) {
+	struct planned_file *pf = calloc(1, sizeof(struct planned_file));
+	if(pf == NULL) { return NULL; }
+	pf->budget = budget;
+	struct stat st;
+	if((pf->fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0 || fstat(pf->fd, &st) != 0) {
+		planio_close(pf);
+		return NULL;
+	}
+	pf->stats.file_size = st.st_size;
+	if(read_range(pf, 0, HEADER_WINDOW) == -1) { return pf; }
+	struct range *ranges = NULL;
+	int n = 0;
+	unsigned char magic[8];
+	if(copy_cached(pf, 0, magic, 8) == 8 && memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0) {
+		plan_png(pf, &ranges, &n);
+	} else if(copy_cached(pf, 0, magic, 2) == 2 && magic[0] == 0xff && magic[1] == 0xd8) {
+		plan_jpg(pf, &ranges, &n);
+	}
+	read_ranges(pf, ranges, n);
+	free(ranges);
+	return pf;
+}
+
+static ssize_t cursor_read(void *cookie, char *buf, size_t size) {
+	struct cursor *c = cookie;
+	struct planned_file *pf = c->pf;
+	if(c->pos >= pf->stats.file_size) { return 0; }
+	// Anything the plan missed is read on demand.
+	if(cached_length(pf, c->pos) == 0 && read_range(pf, c->pos, PROBE) == -1) {
+		errno = pf->stats.over_budget ? EFBIG : EIO;
+		return -1;
+	}
+	long long n = copy_cached(pf, c->pos, (unsigned char*) buf, size);
+	c->pos += n;
+	return n;
+}
+
+static int cursor_seek(void *cookie, off64_t *offset, int whence) {
+	struct cursor *c = cookie;
+	long long pos;
+	switch(whence) {
+		case SEEK_SET: pos = *offset; break;
+		case SEEK_CUR: pos = c->pos + *offset; break;
+		case SEEK_END: pos = c->pf->stats.file_size + *offset; break;
+		default: return -1;
+	}
+	if(pos < 0) { return -1; }
+	*offset = c->pos = pos;
+	return 0;
+}
+
+static int cursor_close(void *cookie) {
+	free(cookie);
+	return 0;
+}
+
+/*
+ * Returns a new read-only stream at the start of the planned file, or NULL.
+ * Seeking on it never does I/O.
+ */
+FILE* planio_stream(struct planned_file *pf) {
+	struct cursor *c = malloc(sizeof(struct cursor));
+	if(c == NULL) { return NULL; }
+	c->pf = pf;
+	c->pos = 0;
+	cookie_io_functions_t io = { cursor_read, NULL, cursor_seek, cursor_close };
+	FILE *f = fopencookie(c, "r", io);
+	if(f == NULL) { free(c); }
+	return f;
+}
+
+/*
+ * Returns how much of the planned file has been read so far.
+ */
+struct io_stats* planio_stats(struct planned_file *pf) {
+	return &pf->stats;
+}
+
+void planio_close(struct planned_file *pf) {
+	int i;
+	for(i = 0; i < pf->nextents; i++) { free(pf->extents[i].data); }
+	free(pf->extents);
+	if(pf->fd >= 0) { close(pf->fd); }
+	free(pf);
+}
@@ -0,0 +1,19 @@
+#ifndef PLANIO_H_GUARD
+#define PLANIO_H_GUARD
+
+#include <stdio.h>
+#include "report.h"
+
+/*
+ * A file read with as few pread calls as its structure allows, for stores
+ * where every read is a round trip. The parsers see it through an ordinary
+ * stream.
+ */
+struct planned_file;
+
+struct planned_file* planio_open(const char *filename, long long budget);
+FILE* planio_stream(struct planned_file *pf);
+struct io_stats* planio_stats(struct planned_file *pf);
+void planio_close(struct planned_file *pf);
+
+#endif
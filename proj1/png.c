@@ -4,6 +4,7 @@
 #include <zlib.h>
 #include "png.h"
 #include "fpeek.h"
+#include "report.h"
 
 // Every PNG starts with these 8 bytes. Make sure to specify the length
 // otherwise the comiler will attach a null char at the end.
@@ -25,6 +26,13 @@ int array_cmp(unsigned char a[], unsigned char b[], int n) {
 	return 0;
 }
 
+/*
+ * Returns 0 if 'bytes' are the 8 bytes every PNG starts with, otherwise -1.
+ */
+int is_png_header(unsigned char bytes[8]) {
+	return array_cmp(bytes, PNG_HEADER, 8);
+}
+
 /* 
  * Ensures that the first 8 bytes of 'f' are equal to 'PNG_HEADER'.
  * If the header is valid, returns 0, otherwise -1.
@@ -52,6 +60,20 @@ int parse_int(FILE *f) {
 	return length;
 }
 
+/*
+ * Returns the index of the chunk type 'bytes' in CHUNK_TYPES, or 3 if it is
+ * not one of them.
+ */
+int find_png_chunktype(unsigned char bytes[4]) {
+	int i;
+	for(i = 0; i < 3; i++) {
+		if(array_cmp(bytes, CHUNK_TYPES[i], 4) != -1) {
+			return i;
+		}
+	}
+	return 3;
+}
+
 /*
  * Returns the index of 'chunktype' in CHUNK_TYPES, otherwise -1.
  */
@@ -63,12 +85,7 @@ int parse_png_chunktype(FILE *f) {
 		if(c == EOF) { return -1; }
 		bytes[i] = c;
 	}
-	for(i = 0; i < 3; i++) {
-		if(array_cmp(bytes, CHUNK_TYPES[i], 4) != -1) {
-			return i;
-		}
-	}
-	return 3;
+	return find_png_chunktype(bytes);
 }
 
 /*
@@ -97,16 +114,15 @@ int find_pivot(unsigned char data[], int length) {
  * Parses 'data' expecting a tEXt chunk. Returns 0 if parsing succeeds,
  * otherwise -1.
  */
-int parse_tEXt(unsigned char data[], int length) {
+int parse_tEXt(unsigned char data[], int length, struct report *r) {
 	// Find the key-value separator.
 	int pivot = find_pivot(data, length);
 	if(pivot == -1) { return -1; }
 	// Calculate the length and address of the value.
 	unsigned int value_len = length - pivot - 1;
 	unsigned char* value = data + pivot + 1;
-	// The key has a null terminator and the next two arguments specify how many
-	// characters to print and from which address.
-	printf("%s: %.*s\n", data, value_len, value);
+	// The key has a null terminator and the value is 'value_len' characters.
+	report_field(r, (char*) data, (char*) value, value_len);
 	return 0;
 }
 
@@ -114,7 +130,7 @@ int parse_tEXt(unsigned char data[], int length) {
  * Parses 'data' expecting a zTXt chunk. Returns 0 if parsing succeeds,
  * otherwise -1.
  */
-int parse_zTXt(unsigned char data[], int length) {
+int parse_zTXt(unsigned char data[], int length, struct report *r) {
 	// Find the key-value separator.
 	int pivot = find_pivot(data, length);
 	if(pivot == -1) { return -1; }
@@ -146,9 +162,8 @@ int parse_zTXt(unsigned char data[], int length) {
 		free(value);
 		return -1;
 	}
-	// The key has a null terminator and the next two arguments specify how many
-	// characters to print and from which address.
-	printf("%s: %.*s\n", data, (unsigned int) value_len, value);
+	// The key has a null terminator and the value is 'value_len' characters.
+	report_field(r, (char*) data, (char*) value, value_len);
 	free(value);
 	return 0;
 }
@@ -157,23 +172,43 @@ int parse_zTXt(unsigned char data[], int length) {
  * Parses 'data' expecting a tIME chunk. Returns 0 if parsing succeeds,
  * otherwise -1.
  */
-int parse_tIME(unsigned char data[], int length) {
+int parse_tIME(unsigned char data[], int length, struct report *r) {
 	// All tIME chunks should be 7 bytes long.
 	if(length != 7) { return -1; }
 	// Combine data[0] and data[1] to form a 16 bit int.
 	int year = (data[0] << 8) | data[1];
-	printf("Timestamp: %d/%d/%d %d:%d:%d\n",
+	char value[32];
+	int value_len = snprintf(value, sizeof(value), "%d/%d/%d %d:%d:%d",
 		data[2], data[3], year,
 		data[4], data[5], data[6]);
+	report_field(r, "Timestamp", value, value_len);
 	return 0;
 }
 
+/*
+ * Checks the data of a chunk of type 'chunktype' against 'expected_checksum'
+ * and parses it. Returns 0 if parsing succeeds, otherwise -1.
+ */
+int parse_png_data(int chunktype, unsigned char data[], int length, int expected_checksum, struct report *r) {
+	// Generate checksum.
+	int actual_checksum = generate_checksum(chunktype, data, length);
+	// Compare checksums.
+	if(actual_checksum != expected_checksum) { return -1; }
+	// Parse data based on chunk type.
+	switch(chunktype) {
+		case 0: return parse_tEXt(data, length, r);
+		case 1: return parse_zTXt(data, length, r);
+		case 2: return parse_tIME(data, length, r);
+	}
+	return -1;
+}
+
 /*
  * Reads from 'f' and attempts to parse a chunk.
  * Returns 1 if a chunk is parsed, 0 if it was the last chunk in the file, and
  * -1 if the chunk was invalid.
  */
-int parse_png_chunk(FILE *f) {
+int parse_png_chunk(FILE *f, struct report *r) {
 	// Parse length.
 	int length = parse_int(f);
 	if(length < 0) { return -1; }
@@ -199,20 +234,7 @@ int parse_png_chunk(FILE *f) {
 			free(data);
 			return -1;
 		}
-		// Generate checksum.
-		int actual_checksum = generate_checksum(chunktype, data, length);
-		// Compare checksums.
-		if(actual_checksum != expected_checksum) {
-			free(data);
-			return -1;
-		}
-		// Parse data based on chunk type.
-		int parse_data = -1;
-		switch(chunktype) {
-			case 0: parse_data = parse_tEXt(data, length); break;
-			case 1: parse_data = parse_zTXt(data, length); break;
-			case 2: parse_data = parse_tIME(data, length); break;
-		}
+		int parse_data = parse_png_data(chunktype, data, length, expected_checksum, r);
 		free(data);
 		if(parse_data == -1) { return -1; }
 	}
@@ -224,13 +246,13 @@ int parse_png_chunk(FILE *f) {
 
 /*
  * Analyze a PNG file.
- * If it is a PNG file, print out all relevant metadata and return 0.
- * If it isn't a PNG file, return -1 and print nothing.
+ * If it is a PNG file, report all relevant metadata to 'r' and return 0.
+ * If it isn't a PNG file, return -1 and report nothing.
  */
-int analyze_png(FILE *f) {
+int analyze_png(FILE *f, struct report *r) {
 	if(validate_png_header(f) != -1) {
 		int c;
-		while((c = parse_png_chunk(f))) {
+		while((c = parse_png_chunk(f, r))) {
 			if(c < 0) { return -1; }
 		}
 		return 0;
@@ -1,6 +1,12 @@
 #ifndef PNG_H_GUARD
 #define PNG_H_GUARD
 
-int analyze_png(FILE *f);
+#include <stdio.h>
+#include "report.h"
+
+int is_png_header(unsigned char bytes[8]);
+int find_png_chunktype(unsigned char bytes[4]);
+int parse_png_data(int chunktype, unsigned char data[], int length, int expected_checksum, struct report *r);
+int analyze_png(FILE *f, struct report *r);
 
 #endif
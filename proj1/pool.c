@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pool.h"
+
+// A queued item.
+struct job {
+	void *item;
+	struct job *next;
+};
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct job *head, *tail;
+	// Set once no more items will be submitted.
+	int closing;
+	int threads;
+	pthread_t *tids;
+	void (*work)(int worker, void *item, void *ctx);
+	void *ctx;
+};
+
+// Passed to each worker thread so it knows its own index.
+struct worker_arg {
+	struct pool *p;
+	int worker;
+};
+
+/*
+ * Runs queued items until the pool is closing and the queue is empty.
+ */
+static void* worker_main(void *arg) {
+	struct pool *p = ((struct worker_arg*) arg)->p;
+	int worker = ((struct worker_arg*) arg)->worker;
+	free(arg);
+	pthread_mutex_lock(&p->lock);
+	for(;;) {
+		while(p->head == NULL && !p->closing) {
+			pthread_cond_wait(&p->ready, &p->lock);
+		}
+		if(p->head == NULL) { break; }
+		struct job *job = p->head;
+		p->head = job->next;
+		if(p->head == NULL) { p->tail = NULL; }
+		pthread_mutex_unlock(&p->lock);
+		p->work(worker, job->item, p->ctx);
+		free(job);
+		pthread_mutex_lock(&p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/*
+ * Returns the number of online CPUs, or 1 if it cannot be determined.
+ */
+int pool_default_threads(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+}
+
+/*
+ * Starts 'threads' workers calling 'work' on each submitted item. Returns NULL
+ * if the pool could not be created.
+ */
+struct pool* pool_create(int threads, void (*work)(int worker, void *item, void *ctx), void *ctx) {
+	if(threads < 1) { threads = 1; }
+	struct pool *p = calloc(1, sizeof(struct pool));
+	if(p == NULL) { return NULL; }
+	p->tids = calloc(threads, sizeof(pthread_t));
+	if(p->tids == NULL) {
+		free(p);
+		return NULL;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->ready, NULL);
+	p->work = work;
+	p->ctx = ctx;
+	for(p->threads = 0; p->threads < threads; p->threads++) {
+		struct worker_arg *arg = malloc(sizeof(struct worker_arg));
+		if(arg == NULL) { break; }
+		arg->p = p;
+		arg->worker = p->threads;
+		if(pthread_create(&p->tids[p->threads], NULL, worker_main, arg) != 0) {
+			free(arg);
+			break;
+		}
+	}
+	// Make do with however many threads started, as long as one did.
+	if(p->threads == 0) {
+		pool_finish(p);
+		return NULL;
+	}
+	return p;
+}
+
+/*
+ * Queues 'item' for the workers. Returns 0 on success, -1 otherwise.
+ */
+int pool_submit(struct pool *p, void *item) {
+	struct job *job = malloc(sizeof(struct job));
+	if(job == NULL) { return -1; }
+	job->item = item;
+	job->next = NULL;
+	pthread_mutex_lock(&p->lock);
+	if(p->tail != NULL) {
+		p->tail->next = job;
+	} else {
+		p->head = job;
+	}
+	p->tail = job;
+	pthread_cond_signal(&p->ready);
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+/*
+ * Waits for every queued item to be worked on, then stops the workers and
+ * frees the pool.
+ */
+void pool_finish(struct pool *p) {
+	int i;
+	pthread_mutex_lock(&p->lock);
+	p->closing = 1;
+	pthread_cond_broadcast(&p->ready);
+	pthread_mutex_unlock(&p->lock);
+	for(i = 0; i < p->threads; i++) {
+		pthread_join(p->tids[i], NULL);
+	}
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->ready);
+	free(p->tids);
+	free(p);
+}
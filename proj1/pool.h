@@ -0,0 +1,16 @@
+#ifndef POOL_H_GUARD
+#define POOL_H_GUARD
+
+/*
+ * A fixed set of worker threads pulling items off a shared FIFO queue. 'work'
+ * is called with the index of the worker thread running it, so callers can
+ * keep per-thread state in an array indexed by it.
+ */
+struct pool;
+
+struct pool* pool_create(int threads, void (*work)(int worker, void *item, void *ctx), void *ctx);
+int pool_submit(struct pool *p, void *item);
+void pool_finish(struct pool *p);
+int pool_default_threads(void);
+
+#endif
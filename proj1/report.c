@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <string.h>
+#include "report.h"
+
+/*
+ * Returns the stream printed to when a callback is not set.
+ */
+static FILE* report_out(struct report *r) {
+	return r->out ? r->out : stdout;
+}
+
+/*
+ * Starts the report for 'filename'.
+ */
+void report_begin(struct report *r, const char *filename) {
+	if(r->begin != NULL) {
+		r->begin(r, filename);
+		return;
+	}
+	fprintf(report_out(r), "File: %s\n", filename);
+}
+
+/*
+ * Hands a key-value pair to the report. 'value' does not have to be null
+ * terminated, but like the printed output it ends at the first null character
+ * within 'length'.
+ */
+void report_field(struct report *r, const char *key, const char *value, int length) {
+	if(length < 0) { length = 0; }
+	length = strnlen(value, length);
+	if(r->field != NULL) {
+		r->field(r, key, value, length);
+		return;
+	}
+	fprintf(report_out(r), "%s: %.*s\n", key, length, value);
+}
+
+/*
+ * Reports an embedded thumbnail of 'length' bytes at 'offset' in the file.
+ */
+void report_thumbnail(struct report *r, long long offset, long long length) {
+	if(r->thumbnail != NULL) {
+		r->thumbnail(r, offset, length);
+	}
+}
+
+/*
+ * Reports how much of 'filename' was read.
+ */
+void report_io(struct report *r, const char *filename, struct io_stats *io) {
+	if(r->io != NULL) {
+		r->io(r, filename, io);
+		return;
+	}
+	fprintf(report_out(r), "Read: %lld of %lld bytes in %d reads%s\n",
+		io->bytes_read, io->file_size, io->reads,
+		io->over_budget ? " (I/O budget exceeded)" : "");
+}
+
+/*
+ * Finishes the report for 'filename'; 'rv' is -1 if it could not be analyzed.
+ */
+void report_end(struct report *r, const char *filename, int rv) {
+	if(r->end != NULL) {
+		r->end(r, filename, rv);
+		return;
+	}
+	if(rv < 0) {
+		fprintf(report_out(r), "Error reading file %s\n", filename);
+	}
+}
@@ -0,0 +1,38 @@
+#ifndef REPORT_H_GUARD
+#define REPORT_H_GUARD
+
+#include <stdio.h>
+
+// How much of a file was read to analyze it.
+struct io_stats {
+	long long bytes_read;
+	long long file_size;
+	int reads;
+	// Set if the analysis gave up because of the I/O budget.
+	int over_budget;
+};
+
+/*
+ * Where the parsers send the metadata they find. 'begin' and 'end' bracket
+ * each file and 'field' is called once per key-value pair in between. 'io'
+ * is called before 'end' when files are read with pread planning. Any
+ * callback left NULL prints to 'out' in the usual "key: value" format, except
+ * 'thumbnail': parsers only look for thumbnails when it is set.
+ */
+struct report {
+	FILE *out;
+	void (*begin)(struct report *r, const char *filename);
+	void (*field)(struct report *r, const char *key, const char *value, int length);
+	void (*end)(struct report *r, const char *filename, int rv);
+	void (*io)(struct report *r, const char *filename, struct io_stats *io);
+	void (*thumbnail)(struct report *r, long long offset, long long length);
+	void *ctx;
+};
+
+void report_begin(struct report *r, const char *filename);
+void report_field(struct report *r, const char *key, const char *value, int length);
+void report_thumbnail(struct report *r, long long offset, long long length);
+void report_io(struct report *r, const char *filename, struct io_stats *io);
+void report_end(struct report *r, const char *filename, int rv);
+
+#endif
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "shard.h"
+#include "analyze.h"
+#include "table.h"
+
+/*
+ * A shard output file is a sequence of records, each the usual text output for
+ * one file behind a header line giving its sizes:
+ *
+ *   <record length> <path length>\n<path><record>
+ *
+ * so that paths and values with newlines in them cannot throw off a merge.
+ * Records are in canonical order, which is bytewise order of the paths. The
+ * checkpoint next to it, <output>.ckpt, records how many of the shard's files
+ * are done, a hash of their paths, and where in the output they end.
+ */
+
+// One shard output being merged.
+struct source {
+	FILE *f;
+	char *path;
+	long path_len;
+	char *record;
+	long record_len;
+};
+
+/*
+ * Parses "i/N" into 'index' and 'count'. Returns 0 on success, -1 otherwise.
+ */
+int shard_parse(const char *spec, int *index, int *count) {
+	char end;
+	if(sscanf(spec, "%d/%d%c", index, count, &end) != 2) { return -1; }
+	if(*count < 1 || *index < 0 || *index >= *count) { return -1; }
+	return 0;
+}
+
+/*
+ * Returns 'hash' extended with 'path', so that a list hashed one path at a
+ * time changes if any path in it or their order does.
+ */
+static unsigned long long hash_path(unsigned long long hash, const char *path) {
+	return (hash ^ table_hash(path, strlen(path))) * 0x100000001b3ULL;
+}
+
+static int compare_paths(const void *x, const void *y) {
+	return strcmp(*(char**) x, *(char**) y);
+}
+
+/*
+ * Keeps only the files in 'files' belonging to shard 'index' of 'count',
+ * which depends only on the path as given, and sorts them into canonical
+ * order. Returns how many files are left.
+ */
+int shard_select(char **files, int nfiles, int index, int count) {
+	int i, n = 0;
+	for(i = 0; i < nfiles; i++) {
+		if(table_hash(files[i], strlen(files[i])) % count == index) { files[n++] = files[i]; }
+	}
+	qsort(files, n, sizeof(char*), compare_paths);
+	return n;
+}
+
+/*
+ * Reads the checkpoint for 'output'. Returns 0 and sets 'done', 'bytes' and
+ * 'hash' if one exists for the same shard and the files it covers are still
+ * the first ones in the list, 1 if there is none, or -1 if it does not fit
+ * this run.
+ */
+static int read_checkpoint(const char *ckpt, const char *spec, char **files, int nfiles, int *done, long *bytes,
+	unsigned long long *hash) {
+	FILE *f = fopen(ckpt, "r");
+	if(f == NULL) { return 1; }
+	char saved[64], last[4096];
+	unsigned long long saved_hash;
+	int i, rv = -1;
+	// The rest of the 'last' line is read whole, as a trailing space in the
+	// format would also skip the newline of an empty shard's line.
+	if(fscanf(f, "shard %63s\nfiles %d\nbytes %ld\nhash %llx\nlast", saved, done, bytes, &saved_hash) == 4 &&
+		fgets(last, sizeof(last), f) != NULL) {
+		last[strcspn(last, "\n")] = 0;
+		if(last[0] == ' ') { memmove(last, last + 1, strlen(last)); }
+		*hash = 0;
+		for(i = 0; *done >= 0 && i < *done && i < nfiles; i++) { *hash = hash_path(*hash, files[i]); }
+		if(strcmp(saved, spec) != 0) {
+			fprintf(stderr, "%s is for shard %s, not %s\n", ckpt, saved, spec);
+		} else if(*done < 0 || *done > nfiles || *bytes < 0 || *hash != saved_hash ||
+			(*done > 0 && strcmp(files[*done - 1], last) != 0)) {
+			// Files added or removed before the last one done would be
+			// skipped or duplicated by resuming.
+			fprintf(stderr, "%s does not match the file list\n", ckpt);
+		} else {
+			rv = 0;
+		}
+	} else {
+		fprintf(stderr, "%s is not a checkpoint\n", ckpt);
+	}
+	fclose(f);
+	return rv;
+}
+
+/*
+ * Records that the first 'done' files, whose paths hash to 'hash', are
+ * complete and end at 'bytes' in the output. The checkpoint is replaced in
+ * one rename so a crash never leaves half of one. Returns 0 on success, -1
+ * otherwise.
+ */
+static int write_checkpoint(const char *ckpt, const char *spec, char **files, int done, long bytes,
+	unsigned long long hash) {
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", ckpt);
+	FILE *f = fopen(tmp, "w");
+	if(f == NULL) { return -1; }
+	fprintf(f, "shard %s\nfiles %d\nbytes %ld\nhash %016llx\nlast %s\n", spec, done, bytes, hash,
+		done > 0 ? files[done - 1] : "");
+	if(fclose(f) != 0 || rename(tmp, ckpt) != 0) { return -1; }
+	return 0;
+}
+
+/*
+ * Analyzes 'files', which shard_select() has already picked and sorted for
+ * shard 'spec', appending a record per file to 'output'. A checkpoint is
+ * saved every 'every' files; if one exists, the run resumes after the last
+ * file it covers and anything written past it is dropped. Returns 0 on
+ * success, -1 otherwise.
+ */
+int shard_run(char **files, int nfiles, const char *spec, const char *output, int every) {
+	char ckpt[4096];
+	int i, done = 0;
+	long bytes = 0;
+	unsigned long long hash = 0;
+	snprintf(ckpt, sizeof(ckpt), "%s.ckpt", output);
+	int found = read_checkpoint(ckpt, spec, files, nfiles, &done, &bytes, &hash);
+	if(found == -1) { return -1; }
+	FILE *out = NULL;
+	if(found == 0 && (out = fopen(output, "r+")) != NULL) {
+		// An output shorter than the checkpoint says cannot be resumed.
+		if(fseek(out, 0, SEEK_END) != 0 || ftell(out) < bytes) {
+			fclose(out);
+			out = NULL;
+		}
+	}
+	// Without a usable checkpoint, start the output over.
+	if(out == NULL) {
+		found = 1;
+		done = 0;
+		bytes = 0;
+		hash = 0;
+		if((out = fopen(output, "w")) == NULL) {
+			perror(output);
+			return -1;
+		}
+	}
+	if(found == 0) {
+		if(done > 0) { fprintf(stderr, "Resuming shard %s after %d files\n", spec, done); }
+		// Drop whatever a crashed run wrote after the checkpoint.
+		if(ftruncate(fileno(out), bytes) != 0 || fseek(out, bytes, SEEK_SET) != 0) {
+			perror(output);
+			fclose(out);
+			return -1;
+		}
+	}
+	for(i = done; i < nfiles; i++) {
+		char *buf = NULL;
+		size_t len = 0;
+		FILE *mem = open_memstream(&buf, &len);
+		if(mem == NULL) { break; }
+		struct report r = { .out = mem };
+		analyze(files[i], &r);
+		fclose(mem);
+		fprintf(out, "%lu %lu\n%s", (unsigned long) len, (unsigned long) strlen(files[i]), files[i]);
+		fwrite(buf, 1, len, out);
+		free(buf);
+		hash = hash_path(hash, files[i]);
+		if((i + 1 - done) % every == 0 || i + 1 == nfiles) {
+			if(fflush(out) != 0 || fsync(fileno(out)) != 0 ||
+				write_checkpoint(ckpt, spec, files, i + 1, ftell(out), hash) != 0) {
+				break;
+			}
+		}
+	}
+	if(nfiles == done) { write_checkpoint(ckpt, spec, files, done, bytes, hash); }
+	if(fclose(out) != 0 || i < nfiles) {
+		perror(output);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Reads the next record of 's'. Returns 1 if one was read, 0 at the end of
+ * the file, or -1 if the file is malformed.
+ */
+static int next_record(struct source *s) {
+	unsigned long record_len, path_len;
+	free(s->path);
+	free(s->record);
+	s->path = s->record = NULL;
+	int n = fscanf(s->f, "%lu %lu", &record_len, &path_len);
+	if(n == EOF) { return 0; }
+	if(n != 2 || fgetc(s->f) != '\n') { return -1; }
+	s->path = malloc(path_len + 1);
+	s->record = malloc(record_len + 1);
+	if(s->path == NULL || s->record == NULL ||
+		fread(s->path, 1, path_len, s->f) != path_len ||
+		fread(s->record, 1, record_len, s->f) != record_len) {
+		return -1;
+	}
+	s->path[path_len] = 0;
+	s->path_len = path_len;
+	s->record_len = record_len;
+	return 1;
+}
+
+static int compare_sources(struct source *a, struct source *b) {
+	long n = a->path_len < b->path_len ? a->path_len : b->path_len;
+	int c = memcmp(a->path, b->path, n);
+	if(c != 0) { return c; }
+	return a->path_len < b->path_len ? -1 : a->path_len > b->path_len;
+}
+
+/*
+ * Merges the shard outputs 'outputs' into canonical order on stdout, as the
+ * plain text an unsharded run over the sorted file list prints. A file found
+ * in more than one output is printed once. Returns 0 on success, -1
+ * otherwise.
+ */
+int shard_merge(char **outputs, int n) {
+	int i, rv = 0, live = 0;
+	struct source *s = calloc(n + 1, sizeof(struct source));
+	char *last = NULL;
+	long last_len = 0;
+	if(s == NULL) { return -1; }
+	for(i = 0; i < n; i++) {
+		if((s[i].f = fopen(outputs[i], "r")) == NULL) {
+			perror(outputs[i]);
+			rv = -1;
+			continue;
+		}
+		int got = next_record(&s[i]);
+		if(got == -1) {
+			fprintf(stderr, "Malformed shard output %s\n", outputs[i]);
+			rv = -1;
+		}
+		if(got != 1) {
+			fclose(s[i].f);
+			s[i].f = NULL;
+		} else {
+			live++;
+		}
+	}
+	// Repeatedly print the smallest head record. The number of shards is
+	// small, so a linear scan beats keeping a heap.
+	while(live > 0) {
+		struct source *min = NULL;
+		for(i = 0; i < n; i++) {
+			if(s[i].f != NULL && (min == NULL || compare_sources(&s[i], min) < 0)) { min = &s[i]; }
+		}
+		if(last == NULL || last_len != min->path_len || memcmp(last, min->path, last_len) != 0) {
+			fwrite(min->record, 1, min->record_len, stdout);
+			free(last);
+			last = min->path;
+			last_len = min->path_len;
+			min->path = NULL;
+		}
+		int got = next_record(min);
+		if(got != 1) {
+			if(got == -1) {
+				fprintf(stderr, "Malformed shard output %s\n", outputs[min - s]);
+				rv = -1;
+			}
+			fclose(min->f);
+			min->f = NULL;
+			live--;
+		}
+	}
+	free(last);
+	for(i = 0; i < n; i++) {
+		free(s[i].path);
+		free(s[i].record);
+	}
+	free(s);
+	return rv;
+}
@@ -0,0 +1,9 @@
+#ifndef SHARD_H_GUARD
+#define SHARD_H_GUARD
+
+int shard_parse(const char *spec, int *index, int *count);
+int shard_select(char **files, int nfiles, int index, int count);
+int shard_run(char **files, int nfiles, const char *spec, const char *output, int every);
+int shard_merge(char **outputs, int n);
+
+#endif
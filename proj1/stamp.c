@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include "stamp.h"
+
+const char* STAMP_KEYS[] = {
+	"DateTimeOriginal",
+	"DateTimeDigitized",
+	"DateTime",
+	"Timestamp"
+};
+
+const int NSTAMP_KEYS = sizeof(STAMP_KEYS) / sizeof(STAMP_KEYS[0]);
+
+/*
+ * Converts an Exif "YYYY:MM:DD HH:MM:SS" or PNG "M/D/YYYY h:m:s" timestamp to
+ * the sortable form. Returns 0 on success, -1 if 'value' is neither.
+ */
+int stamp_normalize(const char *value, char stamp[STAMP_LEN]) {
+	int y, mo, d, h, mi, s;
+	if(sscanf(value, "%d:%d:%d %d:%d:%d", &y, &mo, &d, &h, &mi, &s) != 6 &&
+		sscanf(value, "%d/%d/%d %d:%d:%d", &mo, &d, &y, &h, &mi, &s) != 6) {
+		return -1;
+	}
+	if(y < 0 || y > 9999 || mo < 0 || mo > 99 || d < 0 || d > 99 ||
+		h < 0 || h > 99 || mi < 0 || mi > 99 || s < 0 || s > 99) {
+		return -1;
+	}
+	snprintf(stamp, STAMP_LEN, "%04d-%02d-%02d %02d:%02d:%02d", y, mo, d, h, mi, s);
+	return 0;
+}
+
+/*
+ * Returns a normalized timestamp as the number YYYYMMDDhhmmss, which sorts the
+ * same way.
+ */
+long long stamp_number(const char *stamp) {
+	long long n = 0;
+	for(; *stamp; stamp++) {
+		if(*stamp >= '0' && *stamp <= '9') { n = n * 10 + (*stamp - '0'); }
+	}
+	return n;
+}
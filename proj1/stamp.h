@@ -0,0 +1,14 @@
+#ifndef STAMP_H_GUARD
+#define STAMP_H_GUARD
+
+// Timestamps are kept as "YYYY-MM-DD HH:MM:SS" so they compare as strings.
+#define STAMP_LEN 20
+
+// Fields that date a file, from most to least preferred.
+extern const char* STAMP_KEYS[];
+extern const int NSTAMP_KEYS;
+
+int stamp_normalize(const char *value, char stamp[STAMP_LEN]);
+long long stamp_number(const char *stamp);
+
+#endif
@@ -0,0 +1,413 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "stream.h"
+#include "png.h"
+#include "jpg.h"
+
+/*
+ * A parser for PNG and JPG data that arrives in pieces and cannot be seeked,
+ * like a pipe, a socket or the output of a decompressor. It reports the same
+ * metadata as analyze_png() and analyze_jpg() in one forward pass over the
+ * data, and keeps only the text chunks and the APP1 segment in memory, since
+ * those are the only parts it parses.
+ */
+
+// How much is read from a descriptor at a time.
+#define READ_SIZE 65536
+
+enum state {
+	// The first 8 bytes, which tell a PNG from a JPG.
+	SNIFF,
+	PNG_LENGTH,
+	PNG_TYPE,
+	// The data of a text chunk, kept in 'data'.
+	PNG_DATA,
+	PNG_CRC,
+	JPG_MARKER,
+	JPG_LENGTH,
+	// The data after a superchunk marker, up to the next marker.
+	JPG_SCAN,
+	// The APP1 segment, kept in 'data'.
+	JPG_APP1,
+	// Data that is not needed; 'after' is the state that follows it.
+	SKIP,
+	DONE
+};
+
+struct stream {
+	struct report *r;
+	enum state state;
+	enum state after;
+	// The result, once the state is DONE.
+	int rv;
+	// Set where the data may end: between chunks and at the start of
+	// superchunk data.
+	int clean;
+	// Fixed-size fields are gathered here, since they can span pieces.
+	unsigned char field[8];
+	int have;
+	// The chunk being read: how much of it is left, and its type or marker.
+	long long remaining;
+	int chunktype;
+	int marker;
+	// The data kept from the chunk so far.
+	unsigned char *data;
+	long long kept;
+	long long size;
+	// Set in JPG_SCAN when the last byte was 0xff.
+	int saw_ff;
+	// Where the data being fed starts in the stream, and where the APP1
+	// segment starts, so offsets into it can be reported as in a file.
+	long long pos;
+	long long app1;
+};
+
+/*
+ * Creates a parser reporting to 'r', or returns NULL if out of memory.
+ */
+struct stream* stream_create(struct report *r) {
+	struct stream *s = calloc(1, sizeof(struct stream));
+	if(s == NULL) { return NULL; }
+	s->r = r;
+	s->state = SNIFF;
+	return s;
+}
+
+void stream_free(struct stream *s) {
+	free(s->data);
+	free(s);
+}
+
+static void finish(struct stream *s, int rv) {
+	free(s->data);
+	s->data = NULL;
+	s->state = DONE;
+	s->rv = rv;
+}
+
+/*
+ * Moves past the end of a chunk to 'state', where the data may end.
+ */
+static void next_chunk(struct stream *s, enum state state) {
+	s->state = state;
+	s->have = 0;
+	s->clean = 1;
+}
+
+/*
+ * Skips 'length' bytes and then goes on to 'state'.
+ */
+static void skip(struct stream *s, long long length, enum state state) {
+	s->remaining = length;
+	s->after = state;
+	s->state = SKIP;
+	if(length == 0) { next_chunk(s, state); }
+}
+
+/*
+ * Returns the big-endian 32-bit number in 'bytes'.
+ */
+static unsigned int big32(unsigned char bytes[4]) {
+	return ((unsigned int) bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+/*
+ * Copies bytes from '*p' into 'field' until it holds 'n'. Returns 1 once it
+ * does, 0 if the piece ran out first.
+ */
+static int gather(struct stream *s, const unsigned char **p, const unsigned char *end, int n) {
+	while(s->have < n && *p < end) { s->field[s->have++] = *(*p)++; }
+	return s->have == n;
+}
+
+/*
+ * Appends as much of the chunk as '*p' holds to 'data'. The buffer grows with
+ * the data rather than to the length the chunk claims, which arrives before
+ * any of it. Returns 1 once the whole chunk is kept, 0 if more is needed, or
+ * -1 if out of memory.
+ */
+static int keep(struct stream *s, const unsigned char **p, const unsigned char *end) {
+	long long n = end - *p < s->remaining ? end - *p : s->remaining;
+	if(s->kept + n > s->size) {
+		long long size = s->size ? s->size : 4096;
+		while(size < s->kept + n) { size *= 2; }
+		if(size > s->kept + s->remaining) { size = s->kept + s->remaining; }
+		unsigned char *bigger = realloc(s->data, size);
+		if(bigger == NULL) { return -1; }
+		s->data = bigger;
+		s->size = size;
+	}
+	memcpy(s->data + s->kept, *p, n);
+	s->kept += n;
+	s->remaining -= n;
+	*p += n;
+	return s->remaining == 0;
+}
+
+// A position in the stream, read as a file holding only the kept APP1 data.
+struct cursor {
+	struct stream *s;
+	long long pos;
+};
+
+static ssize_t cursor_read(void *cookie, char *buf, size_t size) {
+	struct cursor *c = cookie;
+	long long at = c->pos - c->s->app1;
+	if(at < 0 || at >= c->s->kept) { return 0; }
+	long long n = c->s->kept - at < size ? c->s->kept - at : size;
+	memcpy(buf, c->s->data + at, n);
+	c->pos += n;
+	return n;
+}
+
+// Unlike fmemopen(), seeking past the end works as it does on a file.
+static int cursor_seek(void *cookie, off64_t *offset, int whence) {
+	struct cursor *c = cookie;
+	long long pos;
+	switch(whence) {
+		case SEEK_SET: pos = *offset; break;
+		case SEEK_CUR: pos = c->pos + *offset; break;
+		case SEEK_END: pos = c->s->app1 + c->s->kept + *offset; break;
+		default: return -1;
+	}
+	if(pos < 0) { return -1; }
+	*offset = c->pos = pos;
+	return 0;
+}
+
+static int cursor_close(void *cookie) {
+	free(cookie);
+	return 0;
+}
+
+/*
+ * Parses the APP1 segment kept so far like parse_app1_chunk() would from the
+ * file, and finishes with its result. The cursor starts where the segment
+ * started in the stream, so thumbnail offsets are the same as in the file.
+ */
+static void parse_app1(struct stream *s) {
+	int rv = -1;
+	FILE *f = NULL;
+	struct cursor *c = malloc(sizeof(struct cursor));
+	if(c != NULL) {
+		c->s = s;
+		c->pos = s->app1;
+		cookie_io_functions_t io = { cursor_read, NULL, cursor_seek, cursor_close };
+		if((f = fopencookie(c, "r", io)) == NULL) { free(c); }
+	}
+	if(f != NULL) {
+		rv = parse_app1_chunk(f, s->kept, s->r);
+		fclose(f);
+	}
+	finish(s, rv);
+}
+
+/*
+ * Acts on a JPG chunk marker.
+ */
+static void jpg_marker(struct stream *s, int marker) {
+	s->have = 0;
+	s->marker = marker;
+	if(is_marker(marker) == -1) {
+		finish(s, -1);
+	} else if(is_super_chunk(marker) != -1) {
+		// Superchunk data may be empty at the end of the image.
+		next_chunk(s, JPG_SCAN);
+		s->saw_ff = 0;
+	} else {
+		s->state = JPG_LENGTH;
+	}
+}
+
+/*
+ * Reads through superchunk data to the next marker, a 0xff byte that is not
+ * followed by 0x00.
+ */
+static void jpg_scan(struct stream *s, const unsigned char **p, const unsigned char *end) {
+	while(*p < end) {
+		if(s->saw_ff) {
+			int c = *(*p)++;
+			s->saw_ff = 0;
+			if(c != 0) {
+				jpg_marker(s, 0xff00 | c);
+				return;
+			}
+		} else {
+			const unsigned char *ff = memchr(*p, 0xff, end - *p);
+			*p = ff != NULL ? ff + 1 : end;
+			s->saw_ff = ff != NULL;
+		}
+	}
+}
+
+/*
+ * Parses the next bytes of the data, 'length' bytes at 'data'. They can be
+ * split up anywhere. Returns 1 while more data is wanted, or 0 once the
+ * result is known and the rest of the data would be ignored.
+ */
+int stream_feed(struct stream *s, const unsigned char *data, size_t length) {
+	const unsigned char *p = data, *end = data + length;
+	int got;
+	while(p < end && s->state != DONE) {
+		s->clean = 0;
+		switch(s->state) {
+		case SNIFF:
+			if(!gather(s, &p, end, 8)) { break; }
+			if(is_png_header(s->field) != -1) {
+				s->state = PNG_LENGTH;
+				s->have = 0;
+			} else {
+				// Not a PNG, so start over on the same bytes as a JPG.
+				unsigned char sniffed[8];
+				long long pos = s->pos;
+				memcpy(sniffed, s->field, sizeof(sniffed));
+				s->state = JPG_MARKER;
+				s->have = 0;
+				s->pos = pos + (p - data) - sizeof(sniffed);
+				stream_feed(s, sniffed, sizeof(sniffed));
+				s->pos = pos;
+			}
+			break;
+		case PNG_LENGTH:
+			if(!gather(s, &p, end, 4)) { break; }
+			s->remaining = big32(s->field);
+			// Lengths over 2^31 - 1 are invalid.
+			if(s->remaining > 0x7fffffff) {
+				finish(s, -1);
+				break;
+			}
+			s->state = PNG_TYPE;
+			s->have = 0;
+			break;
+		case PNG_TYPE:
+			if(!gather(s, &p, end, 4)) { break; }
+			s->chunktype = find_png_chunktype(s->field);
+			s->have = 0;
+			// Unknown chunk type or zero length, skip it and the checksum.
+			if(s->chunktype > 2 || s->remaining == 0) {
+				skip(s, s->remaining + 4, PNG_LENGTH);
+			} else {
+				s->kept = s->size = 0;
+				s->state = PNG_DATA;
+			}
+			break;
+		case PNG_DATA:
+			got = keep(s, &p, end);
+			if(got == -1) { finish(s, -1); }
+			if(got == 1) { s->state = PNG_CRC; }
+			break;
+		case PNG_CRC:
+			if(!gather(s, &p, end, 4)) { break; }
+			got = parse_png_data(s->chunktype, s->data, s->kept, big32(s->field), s->r);
+			free(s->data);
+			s->data = NULL;
+			if(got == -1) {
+				finish(s, -1);
+			} else {
+				next_chunk(s, PNG_LENGTH);
+			}
+			break;
+		case JPG_MARKER:
+			if(!gather(s, &p, end, 2)) { break; }
+			jpg_marker(s, (s->field[0] << 8) | s->field[1]);
+			break;
+		case JPG_LENGTH:
+			if(!gather(s, &p, end, 2)) { break; }
+			s->have = 0;
+			// The length covers the length field itself.
+			s->remaining = ((s->field[0] << 8) | s->field[1]) - 2;
+			if(s->remaining <= 0) {
+				next_chunk(s, JPG_MARKER);
+			} else if(is_app1_chunk(s->marker) != -1) {
+				s->kept = s->size = 0;
+				s->app1 = s->pos + (p - data);
+				s->state = JPG_APP1;
+			} else {
+				skip(s, s->remaining, JPG_MARKER);
+			}
+			break;
+		case JPG_SCAN:
+			jpg_scan(s, &p, end);
+			break;
+		case JPG_APP1:
+			got = keep(s, &p, end);
+			if(got == -1) { finish(s, -1); }
+			// There is only one APP1 segment, so this is the end.
+			if(got == 1) { parse_app1(s); }
+			break;
+		case SKIP:
+			if(end - p < s->remaining) {
+				s->remaining -= end - p;
+				p = end;
+			} else {
+				p += s->remaining;
+				next_chunk(s, s->after);
+			}
+			break;
+		case DONE:
+			break;
+		}
+	}
+	s->pos += p - data;
+	return s->state != DONE;
+}
+
+/*
+ * Ends the data. Returns 0 if it held a valid image, -1 otherwise.
+ */
+int stream_finish(struct stream *s) {
+	switch(s->state) {
+	case SNIFF: {
+		// Too short for a PNG, but not necessarily for a JPG.
+		unsigned char sniffed[8];
+		int n = s->have;
+		memcpy(sniffed, s->field, n);
+		s->state = JPG_MARKER;
+		s->have = 0;
+		s->pos -= n;
+		stream_feed(s, sniffed, n);
+		return s->state == DONE ? s->rv : stream_finish(s);
+	}
+	case JPG_APP1:
+		// Parse as much of the segment as there is.
+		parse_app1(s);
+		break;
+	case SKIP:
+		// Skipping past the end is how a file parser would see it too.
+		finish(s, 0);
+		break;
+	case DONE:
+		break;
+	default:
+		finish(s, s->clean ? 0 : -1);
+		break;
+	}
+	return s->rv;
+}
+
+/*
+ * Reads the data from 'fd' to its end, or until the result is known, and
+ * reports its metadata to 'r'. Returns 0 if it was a valid PNG or JPG, -1
+ * otherwise.
+ */
+int analyze_stream(int fd, struct report *r) {
+	unsigned char *buf = malloc(READ_SIZE);
+	struct stream *s = stream_create(r);
+	int rv = -1;
+	if(buf != NULL && s != NULL) {
+		ssize_t n;
+		int more = 1;
+		while(more && ((n = read(fd, buf, READ_SIZE)) > 0 || (n < 0 && errno == EINTR))) {
+			if(n > 0) { more = stream_feed(s, buf, n); }
+		}
+		// A read error counts as the end of the data.
+		rv = stream_finish(s);
+	}
+	if(s != NULL) { stream_free(s); }
+	free(buf);
+	return rv;
+}
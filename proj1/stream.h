@@ -0,0 +1,15 @@
+#ifndef STREAM_H_GUARD
+#define STREAM_H_GUARD
+
+#include <stddef.h>
+#include "report.h"
+
+struct stream;
+
+struct stream* stream_create(struct report *r);
+int stream_feed(struct stream *s, const unsigned char *data, size_t length);
+int stream_finish(struct stream *s);
+void stream_free(struct stream *s);
+int analyze_stream(int fd, struct report *r);
+
+#endif
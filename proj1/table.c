@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <string.h>
+#include "table.h"
+
+// An occupied slot in the table.
+struct entry {
+	unsigned long long hash;
+	int length;
+	void *value;
+	// The key bytes follow the entry, null terminated.
+	char key[];
+};
+
+struct table {
+	// Open addressing with linear probing; 'size' is a power of two.
+	struct entry **slots;
+	int size;
+	int count;
+};
+
+/*
+ * Returns the 64-bit FNV-1a hash of the first 'length' bytes of 'key'.
+ */
+unsigned long long table_hash(const char *key, int length) {
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	while(length--) {
+		hash ^= (unsigned char) *key++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+ * Creates an empty table, or returns NULL if out of memory.
+ */
+struct table* table_create(void) {
+	struct table *t = malloc(sizeof(struct table));
+	if(t == NULL) { return NULL; }
+	t->size = 64;
+	t->count = 0;
+	t->slots = calloc(t->size, sizeof(struct entry*));
+	if(t->slots == NULL) {
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+/*
+ * Returns the index of the slot holding 'key', or of the empty slot where it
+ * would go.
+ */
+static int find_slot(struct entry **slots, int size, unsigned long long hash, const char *key, int length) {
+	int i = hash & (size - 1);
+	while(slots[i] != NULL) {
+		if(slots[i]->hash == hash && slots[i]->length == length &&
+			memcmp(slots[i]->key, key, length) == 0) {
+			return i;
+		}
+		i = (i + 1) & (size - 1);
+	}
+	return i;
+}
+
+/*
+ * Doubles the number of slots. Returns 0 on success, -1 otherwise.
+ */
+static int grow(struct table *t) {
+	int i, size = t->size * 2;
+	struct entry **slots = calloc(size, sizeof(struct entry*));
+	if(slots == NULL) { return -1; }
+	for(i = 0; i < t->size; i++) {
+		struct entry *e = t->slots[i];
+		if(e != NULL) {
+			slots[find_slot(slots, size, e->hash, e->key, e->length)] = e;
+		}
+	}
+	free(t->slots);
+	t->slots = slots;
+	t->size = size;
+	return 0;
+}
+
+/*
+ * Returns the address of the value stored under 'key', inserting a NULL value
+ * if the key is new. Returns NULL if out of memory.
+ */
+void** table_slot(struct table *t, const char *key, int length) {
+	unsigned long long hash = table_hash(key, length);
+	int i = find_slot(t->slots, t->size, hash, key, length);
+	if(t->slots[i] != NULL) { return &t->slots[i]->value; }
+	// Keep the load factor under 3/4.
+	if((t->count + 1) * 4 > t->size * 3) {
+		if(grow(t) == -1) { return NULL; }
+		i = find_slot(t->slots, t->size, hash, key, length);
+	}
+	struct entry *e = malloc(sizeof(struct entry) + length + 1);
+	if(e == NULL) { return NULL; }
+	e->hash = hash;
+	e->length = length;
+	e->value = NULL;
+	memcpy(e->key, key, length);
+	e->key[length] = 0;
+	t->slots[i] = e;
+	t->count++;
+	return &e->value;
+}
+
+/*
+ * Returns the value stored under 'key', or NULL if there is none.
+ */
+void* table_get(struct table *t, const char *key, int length) {
+	int i = find_slot(t->slots, t->size, table_hash(key, length), key, length);
+	return t->slots[i] != NULL ? t->slots[i]->value : NULL;
+}
+
+/*
+ * Removes 'key' from the table and returns its value, or NULL if it was not
+ * there.
+ */
+void* table_remove(struct table *t, const char *key, int length) {
+	int i = find_slot(t->slots, t->size, table_hash(key, length), key, length);
+	struct entry *e = t->slots[i];
+	if(e == NULL) { return NULL; }
+	void *value = e->value;
+	free(e);
+	t->slots[i] = NULL;
+	t->count--;
+	// Put back the rest of the run, whose entries may have probed past the
+	// freed slot.
+	for(i = (i + 1) & (t->size - 1); t->slots[i] != NULL; i = (i + 1) & (t->size - 1)) {
+		e = t->slots[i];
+		t->slots[i] = NULL;
+		t->slots[find_slot(t->slots, t->size, e->hash, e->key, e->length)] = e;
+	}
+	return value;
+}
+
+/*
+ * Returns the number of keys in the table.
+ */
+int table_count(struct table *t) {
+	return t->count;
+}
+
+/*
+ * Calls 'fn' on every key and value in the table, in no particular order.
+ */
+void table_each(struct table *t, void (*fn)(const char *key, int length, void *value, void *ctx), void *ctx) {
+	int i;
+	for(i = 0; i < t->size; i++) {
+		if(t->slots[i] != NULL) {
+			fn(t->slots[i]->key, t->slots[i]->length, t->slots[i]->value, ctx);
+		}
+	}
+}
+
+/*
+ * Frees the table, calling 'free_value' on each value unless it is NULL.
+ */
+void table_free(struct table *t, void (*free_value)(void *value)) {
+	int i;
+	for(i = 0; i < t->size; i++) {
+		if(t->slots[i] != NULL) {
+			if(free_value != NULL) { free_value(t->slots[i]->value); }
+			free(t->slots[i]);
+		}
+	}
+	free(t->slots);
+	free(t);
+}
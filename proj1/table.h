@@ -0,0 +1,19 @@
+#ifndef TABLE_H_GUARD
+#define TABLE_H_GUARD
+
+/*
+ * A hash table from byte-string keys to pointers. Keys are copied into the
+ * table; values are owned by the caller.
+ */
+struct table;
+
+struct table* table_create(void);
+void** table_slot(struct table *t, const char *key, int length);
+void* table_get(struct table *t, const char *key, int length);
+void* table_remove(struct table *t, const char *key, int length);
+int table_count(struct table *t);
+void table_each(struct table *t, void (*fn)(const char *key, int length, void *value, void *ctx), void *ctx);
+void table_free(struct table *t, void (*free_value)(void *value));
+unsigned long long table_hash(const char *key, int length);
+
+#endif
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "thumbs.h"
+#include "analyze.h"
+#include "pool.h"
+#include "table.h"
+
+// Where the thumbnail of the file being analyzed is, if it has one.
+struct thumb {
+	long long offset;
+	long long length;
+};
+
+struct thumbs {
+	const char *dir;
+	struct thumb *per_worker;
+	// Files that could not be read or whose thumbnail could not be written.
+	int failed;
+};
+
+// Keeps each file's line whole when workers finish at the same time.
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Nothing but the thumbnail is wanted, so the fields are dropped.
+static void on_begin(struct report *r, const char *filename) {
+	struct thumb *t = r->ctx;
+	t->length = 0;
+}
+
+static void on_field(struct report *r, const char *key, const char *value, int length) {
+}
+
+static void on_end(struct report *r, const char *filename, int rv) {
+}
+
+static void on_io(struct report *r, const char *filename, struct io_stats *io) {
+}
+
+static void on_thumbnail(struct report *r, long long offset, long long length) {
+	struct thumb *t = r->ctx;
+	t->offset = offset;
+	t->length = length;
+}
+
+/*
+ * Copies 'length' bytes at 'offset' in 'in' to 'out' inside the kernel, with
+ * copy_file_range where the filesystems allow it and sendfile otherwise.
+ * Returns 0 on success, -1 otherwise.
+ */
+static int copy_range(int in, long long offset, int out, long long length) {
+	loff_t from = offset;
+	int use_sendfile = 0;
+	while(length > 0) {
+		ssize_t n = -1;
+		if(!use_sendfile) {
+			n = copy_file_range(in, &from, out, NULL, length, 0);
+			if(n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+				use_sendfile = 1;
+				continue;
+			}
+		} else {
+			off_t sent_from = from;
+			n = sendfile(out, in, &sent_from, length);
+			if(n > 0) { from = sent_from; }
+		}
+		if(n < 0 && errno == EINTR) { continue; }
+		// The source was truncated under us.
+		if(n <= 0) { return -1; }
+		length -= n;
+	}
+	return 0;
+}
+
+/*
+ * Writes the thumbnail 't' of 'filename' into the output directory. The name
+ * starts with a hash of the full path so equal names from different
+ * directories do not collide. Returns 0 on success, -1 otherwise.
+ */
+static int write_thumbnail(const char *dir, const char *filename, struct thumb *t, char *name, int size) {
+	const char *base = strrchr(filename, '/');
+	base = base ? base + 1 : filename;
+	snprintf(name, size, "%s/%016llx-%s", dir, table_hash(filename, strlen(filename)), base);
+	int in = open(filename, O_RDONLY | O_CLOEXEC);
+	if(in < 0) { return -1; }
+	int out = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if(out < 0) {
+		close(in);
+		return -1;
+	}
+	int rv = copy_range(in, t->offset, out, t->length);
+	close(in);
+	if(close(out) != 0) { rv = -1; }
+	if(rv == -1) {
+		// Keep the copy's error for the message, not unlink's.
+		int saved = errno;
+		unlink(name);
+		errno = saved;
+	}
+	return rv;
+}
+
+static void thumbs_worker(int worker, void *item, void *ctx) {
+	struct thumbs *ts = ctx;
+	struct thumb *t = &ts->per_worker[worker];
+	char *filename = item, name[4096];
+	struct report r = { .begin = on_begin, .field = on_field, .end = on_end, .io = on_io,
+		.thumbnail = on_thumbnail, .ctx = t };
+	// Thumbnails are copied from the file after parsing, which a stream
+	// cannot be read again for.
+	int streamed = is_stream(filename);
+	int analyzed = streamed ? -1 : analyze(filename, &r);
+	int rv = analyzed == 0 && t->length > 0 ? write_thumbnail(ts->dir, filename, t, name, sizeof(name)) : 0;
+	pthread_mutex_lock(&out_lock);
+	if(streamed) {
+		printf("%s: cannot extract thumbnails from a stream\n", filename);
+		ts->failed++;
+	} else if(analyzed < 0) {
+		printf("%s: cannot read file\n", filename);
+		ts->failed++;
+	} else if(t->length == 0) {
+		printf("%s: no thumbnail\n", filename);
+	} else if(rv == -1) {
+		printf("%s: cannot write thumbnail: %s\n", filename, strerror(errno));
+		ts->failed++;
+	} else {
+		printf("%s: %s (%lld bytes)\n", filename, name, t->length);
+	}
+	pthread_mutex_unlock(&out_lock);
+}
+
+/*
+ * Writes the Exif thumbnail of each of 'files' that has one into 'dir', on
+ * 'threads' workers, and prints where each went. The thumbnails are copied
+ * file to file by the kernel, never decoded or read into this process.
+ * Returns 0 on success, -1 if 'dir' cannot be used or a file could not be
+ * read or its thumbnail written.
+ */
+int thumbs_files(char **files, int nfiles, const char *dir, int threads) {
+	int i;
+	struct thumbs ts = { dir, calloc(threads, sizeof(struct thumb)), 0 };
+	if(ts.per_worker == NULL) { return -1; }
+	if(mkdir(dir, 0777) != 0 && errno != EEXIST) {
+		perror(dir);
+		free(ts.per_worker);
+		return -1;
+	}
+	struct pool *p = pool_create(threads, thumbs_worker, &ts);
+	if(p == NULL) {
+		free(ts.per_worker);
+		return -1;
+	}
+	for(i = 0; i < nfiles; i++) {
+		if(pool_submit(p, files[i]) == -1) { break; }
+	}
+	pool_finish(p);
+	free(ts.per_worker);
+	return i < nfiles || ts.failed > 0 ? -1 : 0;
+}
@@ -0,0 +1,6 @@
+#ifndef THUMBS_H_GUARD
+#define THUMBS_H_GUARD
+
+int thumbs_files(char **files, int nfiles, const char *dir, int threads);
+
+#endif
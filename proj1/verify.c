@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "verify.h"
+#include "pool.h"
+
+// Chunks are checksummed in pieces of at most this many bytes, each on
+// whichever worker is free.
+#define PIECE (1 << 20)
+// Inflated IDAT data is thrown away through a buffer this big.
+#define INFLATE_BUF 65536
+
+// A piece of a chunk's type and data, checksummed on its own.
+struct piece {
+	const unsigned char *data;
+	size_t length;
+	uLong crc;
+	struct verify_job *job;
+};
+
+// Where a chunk's pieces and expected CRC are.
+struct chunk {
+	long long offset;
+	unsigned char type[4];
+	uLong expected;
+	int first_piece;
+	int npieces;
+};
+
+// Tracks the pieces of one file still being checksummed.
+struct verify_job {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;
+};
+
+// The outcome for one file.
+struct verdict {
+	char reason[128];
+	int chunks;
+};
+
+static void crc_worker(int worker, void *item, void *ctx) {
+	struct piece *p = item;
+	p->crc = crc32(0L, p->data, p->length);
+	pthread_mutex_lock(&p->job->lock);
+	if(--p->job->pending == 0) { pthread_cond_signal(&p->job->done); }
+	pthread_mutex_unlock(&p->job->lock);
+}
+
+static unsigned long read_be32(const unsigned char *p) {
+	return ((unsigned long) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * Returns the seconds elapsed since 'from'.
+ */
+static double elapsed(struct timespec *from) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from->tv_sec) + (now.tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/*
+ * Inflates the concatenated IDAT data of 'chunks' without keeping the output.
+ * Returns 0 if it is exactly one complete zlib stream, -1 otherwise with the
+ * reason in 'v'.
+ */
+static int inflate_idat(const unsigned char *data, struct chunk *chunks, int nchunks, struct verdict *v) {
+	unsigned char *out = malloc(INFLATE_BUF);
+	z_stream z;
+	int i, result = Z_OK, seen = 0, ended = 0;
+	memset(&z, 0, sizeof(z));
+	if(out == NULL || inflateInit(&z) != Z_OK) {
+		free(out);
+		snprintf(v->reason, sizeof(v->reason), "out of memory");
+		return -1;
+	}
+	for(i = 0; i < nchunks && result != Z_DATA_ERROR; i++) {
+		if(memcmp(chunks[i].type, "IDAT", 4) != 0) {
+			// IDAT chunks have to be consecutive.
+			if(seen && !ended && i + 1 < nchunks && memcmp(chunks[i + 1].type, "IDAT", 4) == 0) {
+				snprintf(v->reason, sizeof(v->reason), "IDAT chunks are not consecutive");
+				result = Z_DATA_ERROR;
+			}
+			continue;
+		}
+		seen = 1;
+		if(ended) {
+			snprintf(v->reason, sizeof(v->reason), "IDAT data after the end of the zlib stream at offset %lld", chunks[i].offset);
+			result = Z_DATA_ERROR;
+			break;
+		}
+		z.next_in = (Bytef*) data + chunks[i].offset + 8;
+		z.avail_in = read_be32(data + chunks[i].offset);
+		while(z.avail_in > 0 && !ended) {
+			z.next_out = out;
+			z.avail_out = INFLATE_BUF;
+			result = inflate(&z, Z_NO_FLUSH);
+			if(result == Z_STREAM_END) {
+				ended = 1;
+			} else if(result != Z_OK && result != Z_BUF_ERROR) {
+				snprintf(v->reason, sizeof(v->reason), "bad zlib data in IDAT at offset %lld: %s",
+					chunks[i].offset, z.msg ? z.msg : "error");
+				result = Z_DATA_ERROR;
+				break;
+			}
+		}
+		if(ended && z.avail_in > 0) {
+			snprintf(v->reason, sizeof(v->reason), "IDAT data after the end of the zlib stream at offset %lld", chunks[i].offset);
+			result = Z_DATA_ERROR;
+		}
+	}
+	// Flush out whatever is still held back for a stream that has not ended.
+	while(seen && !ended && result != Z_DATA_ERROR) {
+		z.next_out = out;
+		z.avail_out = INFLATE_BUF;
+		result = inflate(&z, Z_NO_FLUSH);
+		if(result == Z_STREAM_END) {
+			ended = 1;
+		} else if(result != Z_OK) {
+			break;
+		}
+	}
+	inflateEnd(&z);
+	free(out);
+	if(result == Z_DATA_ERROR) { return -1; }
+	if(!seen) {
+		snprintf(v->reason, sizeof(v->reason), "no IDAT chunk");
+		return -1;
+	}
+	if(!ended) {
+		snprintf(v->reason, sizeof(v->reason), "IDAT zlib stream is truncated");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Verifies a PNG held in memory: the chunk layout, every chunk's CRC, and the
+ * IDAT stream. The CRCs are computed on 'p' while this thread inflates.
+ * Returns 0 if the file is intact, -1 otherwise with the reason in 'v'.
+ */
+static int verify_png(const unsigned char *data, long long size, struct pool *p, struct verdict *v) {
+	struct chunk *chunks = NULL;
+	struct piece *pieces = NULL;
+	int nchunks = 0, npieces = 0, i, k, rv = -1;
+	long long offset = 8;
+	struct verify_job job;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.done, NULL);
+	job.pending = 0;
+
+	// Lay out the chunks and split them into pieces.
+	while(offset < size) {
+		if(size - offset < 12) {
+			snprintf(v->reason, sizeof(v->reason), "truncated chunk header at offset %lld", offset);
+			goto done;
+		}
+		unsigned long length = read_be32(data + offset);
+		if(length > 0x7fffffff || length > size - offset - 12) {
+			snprintf(v->reason, sizeof(v->reason), "chunk at offset %lld runs past the end of the file", offset);
+			goto done;
+		}
+		if(nchunks % 64 == 0) {
+			struct chunk *more = realloc(chunks, (nchunks + 64) * sizeof(struct chunk));
+			if(more == NULL) { goto oom; }
+			chunks = more;
+		}
+		struct chunk *c = &chunks[nchunks++];
+		c->offset = offset;
+		memcpy(c->type, data + offset + 4, 4);
+		c->expected = read_be32(data + offset + 8 + length);
+		c->first_piece = npieces;
+		// The CRC covers the type and the data.
+		long long covered = 4 + (long long) length;
+		c->npieces = (covered + PIECE - 1) / PIECE;
+		struct piece *more = realloc(pieces, (npieces + c->npieces) * sizeof(struct piece));
+		if(more == NULL) { goto oom; }
+		pieces = more;
+		for(k = 0; k < c->npieces; k++) {
+			long long start = (long long) k * PIECE;
+			pieces[npieces].data = data + offset + 4 + start;
+			pieces[npieces].length = covered - start < PIECE ? covered - start : PIECE;
+			pieces[npieces].job = &job;
+			npieces++;
+		}
+		offset += 12 + length;
+		if(memcmp(c->type, "IEND", 4) == 0) { break; }
+	}
+	if(nchunks == 0 || memcmp(chunks[0].type, "IHDR", 4) != 0) {
+		snprintf(v->reason, sizeof(v->reason), "first chunk is not IHDR");
+		goto done;
+	}
+	if(memcmp(chunks[nchunks - 1].type, "IEND", 4) != 0) {
+		snprintf(v->reason, sizeof(v->reason), "no IEND chunk, file is truncated");
+		goto done;
+	}
+	if(offset != size) {
+		snprintf(v->reason, sizeof(v->reason), "%lld bytes after IEND", size - offset);
+		goto done;
+	}
+	v->chunks = nchunks;
+
+	// Small files are not worth handing out.
+	if(p == NULL || size <= PIECE) {
+		for(i = 0; i < npieces; i++) { pieces[i].crc = crc32(0L, pieces[i].data, pieces[i].length); }
+	} else {
+		job.pending = npieces;
+		for(i = 0; i < npieces; i++) {
+			if(pool_submit(p, &pieces[i]) == -1) {
+				// Do the rest here rather than wait for pieces never queued.
+				pthread_mutex_lock(&job.lock);
+				job.pending -= npieces - i;
+				pthread_mutex_unlock(&job.lock);
+				for(; i < npieces; i++) { pieces[i].crc = crc32(0L, pieces[i].data, pieces[i].length); }
+			}
+		}
+	}
+	int idat = inflate_idat(data, chunks, nchunks, v);
+	pthread_mutex_lock(&job.lock);
+	while(job.pending > 0) { pthread_cond_wait(&job.done, &job.lock); }
+	pthread_mutex_unlock(&job.lock);
+
+	// Combine each chunk's pieces and compare, reporting the first bad chunk.
+	for(i = 0; i < nchunks; i++) {
+		struct chunk *c = &chunks[i];
+		uLong crc = pieces[c->first_piece].crc;
+		for(k = 1; k < c->npieces; k++) {
+			struct piece *pc = &pieces[c->first_piece + k];
+			crc = crc32_combine(crc, pc->crc, pc->length);
+		}
+		if(crc != c->expected) {
+			snprintf(v->reason, sizeof(v->reason), "bad CRC in %.4s chunk at offset %lld", c->type, c->offset);
+			goto done;
+		}
+	}
+	rv = idat;
+	goto done;
+oom:
+	snprintf(v->reason, sizeof(v->reason), "out of memory");
+done:
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.done);
+	free(chunks);
+	free(pieces);
+	return rv;
+}
+
+/*
+ * Verifies the segment layout of a JPEG held in memory, which has no
+ * checksums: every segment has to fit in the file and the image has to end
+ * with EOI. Returns 0 if the file is intact, -1 otherwise with the reason in
+ * 'v'.
+ */
+static int verify_jpg(const unsigned char *data, long long size, struct verdict *v) {
+	long long offset = 2;
+	while(offset + 2 <= size) {
+		if(data[offset] != 0xff) {
+			snprintf(v->reason, sizeof(v->reason), "expected a marker at offset %lld", offset);
+			return -1;
+		}
+		int marker = data[offset + 1];
+		// Fill bytes may precede a marker.
+		if(marker == 0xff) {
+			offset++;
+			continue;
+		}
+		v->chunks++;
+		if(marker == 0xd9) {
+			offset += 2;
+			if(offset != size) {
+				snprintf(v->reason, sizeof(v->reason), "%lld bytes after EOI", size - offset);
+				return -1;
+			}
+			return 0;
+		}
+		if((marker >= 0xd0 && marker <= 0xd7) || marker == 0x01) {
+			offset += 2;
+			continue;
+		}
+		if(offset + 4 > size) { break; }
+		long long end = offset + 2 + ((data[offset + 2] << 8) | data[offset + 3]);
+		if(end > size) {
+			snprintf(v->reason, sizeof(v->reason), "segment at offset %lld runs past the end of the file", offset);
+			return -1;
+		}
+		offset = end;
+		// Entropy coded data runs until a marker other than a stuffed zero or
+		// a restart marker.
+		if(marker == 0xda) {
+			while(offset + 1 < size && (data[offset] != 0xff || data[offset + 1] == 0x00 ||
+				(data[offset + 1] >= 0xd0 && data[offset + 1] <= 0xd7))) {
+				offset++;
+			}
+		}
+	}
+	snprintf(v->reason, sizeof(v->reason), "no EOI marker, file is truncated");
+	return -1;
+}
+
+/*
+ * Verifies one file and prints its verdict. Returns 0 if it is intact, -1
+ * otherwise; 'bytes' is set to the size of the file.
+ */
+static int verify_file(char *filename, struct pool *p, long long *bytes) {
+	struct verdict v;
+	struct timespec start;
+	int rv = -1;
+	memset(&v, 0, sizeof(v));
+	*bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	printf("File: %s\n", filename);
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+		snprintf(v.reason, sizeof(v.reason), fd < 0 ? "cannot open file" : "empty file");
+	} else {
+		unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data == MAP_FAILED) {
+			snprintf(v.reason, sizeof(v.reason), "cannot map file");
+		} else {
+			*bytes = st.st_size;
+			// The whole file is about to be read once, front to back.
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			if(st.st_size >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) {
+				rv = verify_png(data, st.st_size, p, &v);
+			} else if(st.st_size >= 2 && data[0] == 0xff && data[1] == 0xd8) {
+				rv = verify_jpg(data, st.st_size, &v);
+			} else {
+				snprintf(v.reason, sizeof(v.reason), "not a PNG or JPG file");
+			}
+			munmap(data, st.st_size);
+		}
+	}
+	if(fd >= 0) { close(fd); }
+	double seconds = elapsed(&start);
+	if(rv == 0) {
+		printf("Verify: OK (%d chunks, %lld bytes, %.1f MB/s)\n", v.chunks, *bytes,
+			seconds > 0 ? *bytes / seconds / 1e6 : 0.0);
+	} else {
+		printf("Verify: FAILED (%s)\n", v.reason);
+	}
+	return rv;
+}
+
+/*
+ * Checks the integrity of every file in 'files', one after the other, with
+ * the checksums of large files spread over 'threads' workers. Prints a
+ * verdict per file and the overall throughput. Returns 0 if every file is
+ * intact, -1 otherwise.
+ */
+int verify_files(char **files, int nfiles, int threads) {
+	struct timespec start;
+	long long total = 0, bytes;
+	int i, failed = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	struct pool *p = threads > 1 ? pool_create(threads, crc_worker, NULL) : NULL;
+	for(i = 0; i < nfiles; i++) {
+		if(verify_file(files[i], p, &bytes) == -1) { failed++; }
+		total += bytes;
+	}
+	if(p != NULL) { pool_finish(p); }
+	double seconds = elapsed(&start);
+	printf("Verified: %d files, %d failed, %lld bytes in %.3f s (%.1f MB/s)\n",
+		nfiles, failed, total, seconds, seconds > 0 ? total / seconds / 1e6 : 0.0);
+	return failed ? -1 : 0;
+}
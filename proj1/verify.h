@@ -0,0 +1,6 @@
+#ifndef VERIFY_H_GUARD
+#define VERIFY_H_GUARD
+
+int verify_files(char **files, int nfiles, int threads);
+
+#endif
@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "watch.h"
+#include "analyze.h"
+#include "pool.h"
+#include "table.h"
+
+// Directories are watched for finished files and for new subdirectories, and
+// for files leaving so they can be forgotten.
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR)
+// A batch is handed to the workers early once it holds this many files.
+#define MAX_BATCH 256
+
+// What a file looked like when it was last analyzed, so a rescan after a
+// queue overflow only picks up files that changed.
+struct stamp {
+	struct timespec mtime;
+	off_t size;
+	// The scan that last found the file.
+	unsigned int scan;
+};
+
+struct watch {
+	int fd;
+	// Watched directory paths, indexed by watch descriptor.
+	char **dirs;
+	int ndirs;
+	// Files seen since the batch window opened, keyed by path.
+	struct table *batch;
+	struct timespec opened;
+	// Stamps of every file handed to the workers and still there, keyed by
+	// path.
+	struct table *seen;
+	unsigned int scan;
+	struct pool *pool;
+};
+
+// Keeps each file's output together when workers finish at the same time.
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t stopping = 0;
+
+static void on_signal(int sig) {
+	stopping = 1;
+}
+
+/*
+ * Returns "dir/name" in a newly allocated string, or NULL if out of memory.
+ */
+static char* join_path(const char *dir, const char *name) {
+	char *path = malloc(strlen(dir) + strlen(name) + 2);
+	if(path == NULL) { return NULL; }
+	sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+/*
+ * Returns the number of milliseconds from 'from' to now.
+ */
+static long elapsed_ms(struct timespec *from) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from->tv_sec) * 1000 + (now.tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/*
+ * Analyzes one file into a private buffer and then writes the whole result to
+ * stdout at once.
+ */
+static void analyze_worker(int worker, void *item, void *ctx) {
+	char *path = item;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&buf, &len);
+	if(out != NULL) {
+		struct report r = { .out = out };
+		analyze(path, &r);
+		fclose(out);
+		pthread_mutex_lock(&out_lock);
+		fwrite(buf, 1, len, stdout);
+		fflush(stdout);
+		pthread_mutex_unlock(&out_lock);
+		free(buf);
+	}
+	free(path);
+}
+
+/*
+ * Adds 'path' to the current batch, opening the batch window if it was empty.
+ */
+static void batch_add(struct watch *w, const char *path) {
+	if(table_count(w->batch) == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &w->opened);
+	}
+	table_slot(w->batch, path, strlen(path));
+}
+
+/*
+ * Hands one batched path to the workers and records its stamp.
+ */
+static void dispatch_one(const char *key, int length, void *value, void *ctx) {
+	struct watch *w = ctx;
+	struct stat st;
+	// The file may have been removed since it was batched.
+	if(stat(key, &st) != 0 || !S_ISREG(st.st_mode)) { return; }
+	struct stamp **slot = (struct stamp**) table_slot(w->seen, key, length);
+	if(slot == NULL) { return; }
+	if(*slot == NULL && (*slot = malloc(sizeof(struct stamp))) == NULL) { return; }
+	(*slot)->mtime = st.st_mtim;
+	(*slot)->size = st.st_size;
+	(*slot)->scan = w->scan;
+	char *path = strdup(key);
+	if(path == NULL) { return; }
+	if(pool_submit(w->pool, path) == -1) { free(path); }
+}
+
+/*
+ * Returns whether 'st' differs from the stamp 'old'.
+ */
+static int changed(struct stamp *old, struct stat *st) {
+	return old->mtime.tv_sec != st->st_mtim.tv_sec || old->mtime.tv_nsec != st->st_mtim.tv_nsec ||
+		old->size != st->st_size;
+}
+
+// Paths to forget, collected first since the table cannot change while it is
+// walked.
+struct prune {
+	struct watch *w;
+	// Forget paths under this directory, or if NULL, paths the last scan
+	// did not find.
+	const char *dir;
+	char **paths;
+	int npaths;
+	int size;
+};
+
+static void find_stale(const char *key, int length, void *value, void *ctx) {
+	struct prune *p = ctx;
+	struct stamp *stamp = value;
+	int stale;
+	if(p->dir != NULL) {
+		int n = strlen(p->dir);
+		stale = length > n && strncmp(key, p->dir, n) == 0 && key[n] == '/';
+	} else {
+		stale = stamp->scan != p->w->scan;
+	}
+	if(!stale) { return; }
+	if(p->npaths == p->size) {
+		int size = p->size ? p->size * 2 : 64;
+		char **paths = realloc(p->paths, size * sizeof(char*));
+		if(paths == NULL) { return; }
+		p->paths = paths;
+		p->size = size;
+	}
+	if((p->paths[p->npaths] = strdup(key)) != NULL) { p->npaths++; }
+}
+
+/*
+ * Forgets the stamps of files under 'dir', or if 'dir' is NULL, of files the
+ * last scan did not find, so 'seen' only holds files that are still there.
+ */
+static void prune_seen(struct watch *w, const char *dir) {
+	struct prune p = { w, dir, NULL, 0, 0 };
+	int i;
+	table_each(w->seen, find_stale, &p);
+	for(i = 0; i < p.npaths; i++) {
+		free(table_remove(w->seen, p.paths[i], strlen(p.paths[i])));
+		free(p.paths[i]);
+	}
+	free(p.paths);
+}
+
+/*
+ * Hands the whole batch to the workers and starts a new one.
+ */
+static int batch_flush(struct watch *w) {
+	table_each(w->batch, dispatch_one, w);
+	table_free(w->batch, NULL);
+	w->batch = table_create();
+	return w->batch == NULL ? -1 : 0;
+}
+
+/*
+ * Remembers 'path' as the directory for watch descriptor 'wd'.
+ */
+static int remember_dir(struct watch *w, int wd, const char *path) {
+	if(wd >= w->ndirs) {
+		int i, n = wd * 2 + 16;
+		char **dirs = realloc(w->dirs, n * sizeof(char*));
+		if(dirs == NULL) { return -1; }
+		for(i = w->ndirs; i < n; i++) { dirs[i] = NULL; }
+		w->dirs = dirs;
+		w->ndirs = n;
+	}
+	// Re-adding a watch returns the same descriptor; keep the newest path.
+	free(w->dirs[wd]);
+	w->dirs[wd] = strdup(path);
+	return w->dirs[wd] == NULL ? -1 : 0;
+}
+
+/*
+ * Stops watching 'dir' and every directory below it, once it has been moved
+ * away. Moves within the tree are watched again by the scan on IN_MOVED_TO.
+ */
+static void unwatch_tree(struct watch *w, const char *dir) {
+	int wd, n = strlen(dir);
+	for(wd = 0; wd < w->ndirs; wd++) {
+		const char *path = w->dirs[wd];
+		if(path == NULL || strncmp(path, dir, n) != 0 || (path[n] != 0 && path[n] != '/')) { continue; }
+		// Its IN_IGNORED event finds no path and is dropped.
+		inotify_rm_watch(w->fd, wd);
+		free(w->dirs[wd]);
+		w->dirs[wd] = NULL;
+	}
+}
+
+/*
+ * Watches 'dir' and every directory below it, and batches any file that was
+ * not analyzed before or has changed since. Files that arrived before the
+ * watch was in place are found this way too.
+ */
+static int scan_tree(struct watch *w, const char *dir) {
+	int wd = inotify_add_watch(w->fd, dir, WATCH_MASK);
+	if(wd < 0) {
+		fprintf(stderr, "Cannot watch %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	if(remember_dir(w, wd, dir) == -1) { return -1; }
+	DIR *d = opendir(dir);
+	if(d == NULL) { return -1; }
+	struct dirent *ent;
+	while((ent = readdir(d)) != NULL) {
+		if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) { continue; }
+		char *path = join_path(dir, ent->d_name);
+		if(path == NULL) { break; }
+		struct stat st;
+		// Symbolic links are not followed, so loops cannot form.
+		if(lstat(path, &st) == 0) {
+			if(S_ISDIR(st.st_mode)) {
+				scan_tree(w, path);
+			} else if(S_ISREG(st.st_mode)) {
+				struct stamp *old = table_get(w->seen, path, strlen(path));
+				if(old == NULL || changed(old, &st)) {
+					batch_add(w, path);
+				} else {
+					old->scan = w->scan;
+				}
+			}
+		}
+		free(path);
+	}
+	closedir(d);
+	return 0;
+}
+
+/*
+ * Handles one inotify event.
+ */
+static void handle_event(struct watch *w, struct inotify_event *ev, const char *root) {
+	// Events were dropped, so the only way to catch up is to look again.
+	// Whatever the scan does not find was removed in the meantime.
+	if(ev->mask & IN_Q_OVERFLOW) {
+		w->scan++;
+		scan_tree(w, root);
+		prune_seen(w, NULL);
+		return;
+	}
+	if(ev->wd < 0 || ev->wd >= w->ndirs || w->dirs[ev->wd] == NULL) { return; }
+	// The directory was removed or moved away.
+	if(ev->mask & IN_IGNORED) {
+		free(w->dirs[ev->wd]);
+		w->dirs[ev->wd] = NULL;
+		return;
+	}
+	if(ev->len == 0) { return; }
+	char *path = join_path(w->dirs[ev->wd], ev->name);
+	if(path == NULL) { return; }
+	if(ev->mask & IN_ISDIR) {
+		if(ev->mask & (IN_CREATE | IN_MOVED_TO)) { scan_tree(w, path); }
+		if(ev->mask & IN_MOVED_FROM) {
+			unwatch_tree(w, path);
+			prune_seen(w, path);
+		}
+	} else if(ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+		batch_add(w, path);
+	} else if(ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		table_remove(w->batch, path, strlen(path));
+		free(table_remove(w->seen, path, strlen(path)));
+	}
+	free(path);
+}
+
+/*
+ * Reads and handles every pending inotify event. Returns -1 on a read error.
+ */
+static int read_events(struct watch *w, const char *root) {
+	char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n = read(w->fd, buf, sizeof(buf));
+	if(n < 0) { return (errno == EINTR || errno == EAGAIN) ? 0 : -1; }
+	char *p = buf;
+	while(p < buf + n) {
+		struct inotify_event *ev = (struct inotify_event*) p;
+		handle_event(w, ev, root);
+		p += sizeof(struct inotify_event) + ev->len;
+	}
+	return 0;
+}
+
+/*
+ * Analyzes every file under 'dir', then keeps analyzing files as they are
+ * written or moved into it until SIGINT or SIGTERM. Files arriving within
+ * 'window_ms' of each other are batched onto 'threads' workers together.
+ * Returns 0 when stopped by a signal, -1 if the directory cannot be watched.
+ */
+int watch_directory(const char *dir, int threads, int window_ms) {
+	struct watch w;
+	int i, rv = 0;
+	memset(&w, 0, sizeof(w));
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	// The signals are only let in while waiting in ppoll(), so one cannot
+	// arrive after 'stopping' is checked and before the wait starts. The
+	// workers inherit the mask and never see them.
+	sigset_t stop_signals, old_mask;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+	w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(w.fd < 0) {
+		perror("inotify_init1");
+		pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+		return -1;
+	}
+	w.batch = table_create();
+	w.seen = table_create();
+	w.pool = pool_create(threads, analyze_worker, NULL);
+	if(w.batch == NULL || w.seen == NULL || w.pool == NULL || scan_tree(&w, dir) == -1) {
+		rv = -1;
+		goto done;
+	}
+	sigset_t waiting = old_mask;
+	sigdelset(&waiting, SIGINT);
+	sigdelset(&waiting, SIGTERM);
+	while(!stopping) {
+		struct timespec timeout, *wait = NULL;
+		if(table_count(w.batch) > 0) {
+			long left = window_ms - elapsed_ms(&w.opened);
+			if(left < 0) { left = 0; }
+			timeout.tv_sec = left / 1000;
+			timeout.tv_nsec = left % 1000 * 1000000;
+			wait = &timeout;
+		}
+		struct pollfd pfd = { w.fd, POLLIN, 0 };
+		int ready = ppoll(&pfd, 1, wait, &waiting);
+		if(ready < 0 && errno != EINTR) {
+			rv = -1;
+			break;
+		}
+		if(ready > 0 && read_events(&w, dir) == -1) {
+			rv = -1;
+			break;
+		}
+		if(table_count(w.batch) >= MAX_BATCH ||
+			(table_count(w.batch) > 0 && elapsed_ms(&w.opened) >= window_ms)) {
+			if(batch_flush(&w) == -1) {
+				rv = -1;
+				break;
+			}
+		}
+	}
+	// Whatever already arrived still gets analyzed.
+	if(w.batch != NULL) { batch_flush(&w); }
+
+done:
+	if(w.pool != NULL) { pool_finish(w.pool); }
+	if(w.batch != NULL) { table_free(w.batch, NULL); }
+	if(w.seen != NULL) { table_free(w.seen, free); }
+	for(i = 0; i < w.ndirs; i++) { free(w.dirs[i]); }
+	free(w.dirs);
+	close(w.fd);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	return rv;
+}
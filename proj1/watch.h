@@ -0,0 +1,6 @@
+#ifndef WATCH_H_GUARD
+#define WATCH_H_GUARD
+
+int watch_directory(const char *dir, int threads, int window_ms);
+
+#endif